@@ -0,0 +1,293 @@
+/**
+ * @file bench.cpp
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * Microbenchmark driver for the lpm lookup structures. Loads a prefix file,
+ * generates deterministic query mixes and reports ns/lookup, lookups/sec and
+ * memory footprint for searchBest, searchExact and insert on the v4 and v6
+ * BinaryTrie instantiations. Built by `make bench`.
+ */
+
+// project headers
+#include "bitarray.h"
+#include "bintrie.h"
+
+// system headers
+#ifdef WIN32
+#include <w32api.h>
+#define WINVER WindowsVista
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#endif
+
+// c++ stl headers
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+typedef BinaryTrie<sizeof(in_addr), int> Bench4Dict;
+typedef BinaryTrie<sizeof(in6_addr), int> Bench6Dict;
+
+typedef Bench4Dict::key_type Bench4Key;
+typedef Bench6Dict::key_type Bench6Key;
+
+// deterministic xorshift so every run replays the same query mixes
+struct XorShift64 {
+    uint64_t state;
+
+    XorShift64(uint64_t seed) : state(seed) { }
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+};
+
+static uint64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void reportRate(const char* label, size_t ops, uint64_t ns, size_t misses) {
+    printf("%-28s %10zu ops  %8.1f ns/op  %8.2f Mops/s  %zu misses\n",
+        label, ops, (double)ns / ops, ops * 1000.0 / ns, misses);
+}
+
+template <size_t N>
+static void parsePrefixes(const char* fileName, vector<pair<BitArray<N>, int> >& v4like, int wantedFamily) {
+    ifstream file(fileName);
+    if (!file)
+        throw runtime_error("Unable to open input file!");
+
+    istringstream iss;
+    string subnet;
+    int as;
+
+    while (!file.eof()) {
+        file >> subnet >> as;
+        if (file.bad())
+            throw runtime_error("Some serious error occured while reading input file!");
+
+        size_t delim = subnet.find_last_of('/');
+        size_t prefixLen = 0;
+        iss.str(subnet.substr(delim + 1));
+        iss.clear();
+        iss >> prefixLen;
+        string prefix = subnet.substr(0, delim);
+
+        unsigned char buf4[4], buf6[16];
+        BitArray<N> key;
+        if (inet_pton(AF_INET, prefix.c_str(), buf4) == 1 && wantedFamily == AF_INET && prefixLen <= 32) {
+            memcpy(key.internalStorage(), buf4, sizeof(buf4));
+            key.setSize(prefixLen);
+            v4like.push_back(make_pair(key, as));
+        } else if (inet_pton(AF_INET6, prefix.c_str(), buf6) == 1 && wantedFamily == AF_INET6 && prefixLen <= 128) {
+            if (N == 16) {
+                memcpy(key.internalStorage(), buf6, sizeof(buf6));
+                key.setSize(prefixLen);
+                v4like.push_back(make_pair(key, as));
+            }
+        }
+    }
+}
+
+template <size_t N>
+static BitArray<N> randomKey(XorShift64& rng) {
+    BitArray<N> key;
+    for (size_t i = 0; i < N; i += 8) {
+        uint64_t r = rng.next();
+        memcpy(key.internalStorage() + i, &r, (N - i < 8) ? N - i : 8);
+    }
+    key.setSize(N * 8);
+    return key;
+}
+
+/**
+ * Fills key's bits below prefixLen from the prefix and the rest randomly,
+ * yielding a full-length address inside the announced prefix.
+ */
+template <size_t N>
+static BitArray<N> keyInsidePrefix(const BitArray<N>& prefix, XorShift64& rng) {
+    BitArray<N> key = randomKey<N>(rng);
+    size_t len = prefix.size();
+    for (size_t i = 0; i < N; i++) {
+        if ((i + 1) * 8 <= len) {
+            key.internalStorage()[i] = prefix.internalStorage()[i];
+        } else if (i * 8 < len) {
+            size_t rem = len - i * 8;
+            unsigned char mask = 0xff << (8 - rem);
+            key.internalStorage()[i] = (prefix.internalStorage()[i] & mask)
+                | (key.internalStorage()[i] & ~mask);
+        }
+    }
+    return key;
+}
+
+template <size_t N>
+static void benchFamily(const char* name, const vector<pair<BitArray<N>, int> >& prefixes, size_t queryCount) {
+    typedef BinaryTrie<N, int> Dict;
+    typedef BitArray<N> Key;
+
+    printf("== %s: %zu prefixes ==\n", name, prefixes.size());
+    if (prefixes.empty())
+        return;
+
+    XorShift64 rng(0x5bd1e995u);
+
+    // insert cost, file order
+    Dict dict;
+    uint64_t t0 = nowNs();
+    for (size_t i = 0; i < prefixes.size(); i++)
+        dict[prefixes[i].first] = prefixes[i].second;
+    uint64_t t1 = nowNs();
+    reportRate("insert", prefixes.size(), t1 - t0, 0);
+    printf("%-28s %10zu nodes  %.1f MB pool\n", "footprint",
+        dict.size(), dict.memoryFootprint() / (1024.0 * 1024.0));
+
+    // query mixes
+    vector<Key> uniform, zipf, deep, exact;
+    uniform.reserve(queryCount);
+    zipf.reserve(queryCount);
+    deep.reserve(queryCount);
+    exact.reserve(queryCount);
+
+    for (size_t i = 0; i < queryCount; i++)
+        uniform.push_back(randomKey<N>(rng));
+
+    // log-uniform rank approximates a Zipf distribution over announced prefixes
+    double logN = log((double)prefixes.size());
+    for (size_t i = 0; i < queryCount; i++) {
+        double u = (rng.next() >> 11) * (1.0 / 9007199254740992.0);
+        size_t rank = (size_t)(exp(u * logN)) - 1;
+        if (rank >= prefixes.size())
+            rank = prefixes.size() - 1;
+        zipf.push_back(keyInsidePrefix(prefixes[rank].first, rng));
+    }
+
+    // worst case: probes inside the longest announced prefixes
+    vector<size_t> byLen(prefixes.size());
+    for (size_t i = 0; i < prefixes.size(); i++)
+        byLen[i] = i;
+    sort(byLen.begin(), byLen.end(), [&prefixes](size_t a, size_t b) {
+        return prefixes[a].first.size() > prefixes[b].first.size();
+    });
+    size_t deepPool = (prefixes.size() < 10000) ? prefixes.size() : 10000;
+    for (size_t i = 0; i < queryCount; i++)
+        deep.push_back(keyInsidePrefix(prefixes[byLen[i % deepPool]].first, rng));
+
+    for (size_t i = 0; i < queryCount; i++)
+        exact.push_back(prefixes[rng.next() % prefixes.size()].first);
+
+    struct Mix { const char* label; const vector<Key>* keys; };
+    Mix mixes[] = {
+        { "searchBest uniform", &uniform },
+        { "searchBest zipf", &zipf },
+        { "searchBest deep", &deep },
+    };
+
+    long checksum = 0;
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        const vector<Key>& keys = *mixes[m].keys;
+        size_t misses = 0;
+
+        t0 = nowNs();
+        for (size_t i = 0; i < keys.size(); i++) {
+            int value;
+            if (dict.tryBest(keys[i], value))
+                checksum += value;
+            else
+                misses++;
+        }
+        t1 = nowNs();
+        reportRate(mixes[m].label, keys.size(), t1 - t0, misses);
+
+        // batched flavour of the same mix
+        vector<int> results(keys.size());
+        bool* matched = new bool[keys.size()];
+        t0 = nowNs();
+        dict.bestBatch(&keys[0], &results[0], matched, keys.size());
+        t1 = nowNs();
+        misses = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (matched[i])
+                checksum += results[i];
+            else
+                misses++;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "%s (batch)", mixes[m].label);
+        reportRate(label, keys.size(), t1 - t0, misses);
+        delete[] matched;
+    }
+
+    // searchExact over announced prefixes, always hits
+    size_t misses = 0;
+    t0 = nowNs();
+    for (size_t i = 0; i < exact.size(); i++) {
+        int value;
+        if (dict.tryAt(exact[i], value))
+            checksum += value;
+        else
+            misses++;
+    }
+    t1 = nowNs();
+    reportRate("searchExact announced", exact.size(), t1 - t0, misses);
+
+    printf("checksum %ld\n\n", checksum);
+}
+
+int main(int argc, char** argv) {
+    const char* inputFile = NULL;
+    size_t queryCount = 1000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            inputFile = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            queryCount = strtoul(argv[++i], NULL, 10);
+        else
+            inputFile = NULL;
+    }
+
+    if (inputFile == NULL) {
+        cout << "Usage:  lpmbench -i FILE [-n QUERIES]" << endl;
+        return 1;
+    }
+
+#ifdef WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        return 1;
+#endif
+
+    vector<pair<Bench4Key, int> > prefixes4;
+    vector<pair<Bench6Key, int> > prefixes6;
+    parsePrefixes(inputFile, prefixes4, AF_INET);
+    parsePrefixes(inputFile, prefixes6, AF_INET6);
+
+    benchFamily("IPv4", prefixes4, queryCount);
+    benchFamily("IPv6", prefixes6, queryCount);
+
+#ifdef WIN32
+    WSACleanup();
+#endif
+
+    return 0;
+}
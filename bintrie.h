@@ -13,170 +13,1318 @@
 #include "bitarray.h"
 
 #include <iostream>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
 
-template <size_t N, class T>
+/**
+ * Compile-time shape of a BinaryTrie instantiation. The depth bounds are
+ * dictated by the key size, the tuning knobs can be overridden by passing
+ * a different traits type, so the v4 and v6 tries get separately sized
+ * lookup code without any runtime branching on key size.
+ */
+template <size_t N>
+struct BinaryTrieTraits
+{
+    /// longest representable prefix in bits
+    static const size_t MAX_DEPTH = N * 8;
+    /// most data nodes on one root-to-leaf path, sizes candidate stacks
+    static const size_t MAX_CANDIDATES = N * 8 + 1;
+    /// lookups advanced in lockstep by bestBatch()
+    static const size_t BATCH_LANES = 16;
+    /// frozen blocks resolve at most this many bits at once
+    static const size_t MAX_BRANCH = 8;
+};
+
+/**
+ * Alloc is rebound to the pool element types and backs the node pool, key
+ * table and frozen form, so a trie can be placed into an arena or
+ * huge-page region of the caller's choice; bookkeeping vectors stay on the
+ * default allocator. Defaults to the global allocator.
+ */
+template <size_t N, class T, class Alloc = std::allocator<char>, class Traits = BinaryTrieTraits<N> >
 class BinaryTrie
 {
 public:
     typedef T mapped_type;
     typedef BitArray<N> key_type;
+    typedef Alloc allocator_type;
+    typedef Traits traits_type;
     //typedef std::pair<const key_type, mapped_type> value_type;
 
-    BinaryTrie() : root(NULL), numNodes(0) { }
+    BinaryTrie()
+        : frozenRootSkip(0), frozenRootBranch(0), root(NIL), freeHead(NIL),
+          numNodes(0), numFree(0), extNodes(NULL), extKeys(NULL) { }
 
-    ~BinaryTrie() {
-        clear();
-    }
+    /// Constructs empty trie whose pools allocate through a copy of alloc.
+    explicit BinaryTrie(const Alloc& alloc)
+        : nodes(NodeAlloc(alloc)), frozenEntries(FrozenEntryAlloc(alloc)),
+          frozenCands(FrozenCandAlloc(alloc)), frozenRootSkip(0), frozenRootBranch(0),
+          keyStore(KeyAlloc(alloc)), root(NIL), freeHead(NIL),
+          numNodes(0), numFree(0), extNodes(NULL), extKeys(NULL) { }
 
     void clear() {
-        if (root) {
-            Node* stack[N * 8 + 1];
-            Node** sp = stack;
-            Node* node = root;
-
-            while (node) {
-                Node* right = node->right;
-                Node* left = node->left;
-
-                delete node;
-
-                if (left) {
-                    if (right)
-                        *sp++ = right;
-                    node = left;
-                } else if (right) {
-                    node = right;
-                } else if (sp != stack) {
-                    node = *(--sp);
-                } else {
-                    node = NULL;
-                }
-            }
+        // nodes live in one contiguous pool, so teardown is a single
+        // deallocation; the swapped-in temporaries keep the allocator
+        std::vector<Node, NodeAlloc>(nodes.get_allocator()).swap(nodes);
+        std::vector<FrozenEntry, FrozenEntryAlloc>(frozenEntries.get_allocator()).swap(frozenEntries);
+        std::vector<FrozenCand, FrozenCandAlloc>(frozenCands.get_allocator()).swap(frozenCands);
+        std::vector<key_type, KeyAlloc>(keyStore.get_allocator()).swap(keyStore);
+        freeKeys.clear();
+        retired.clear();
+        root = NIL;
+        freeHead = NIL;
+        numNodes = 0;
+        numFree = 0;
+        extNodes = NULL;
+        extKeys = NULL;
+    }
 
-            numNodes = 0;
-        }
+    /**
+     * Preallocates pool capacity for at least n nodes. updateInsert() and
+     * updateWithdraw() refuse to grow the pool - growing moves the node
+     * array under running readers - so size the slack here up front.
+     * Must not run concurrently with readers for the same reason.
+     */
+    void reserve(size_t n) {
+        nodes.reserve(n);
+        keyStore.reserve(n);
     }
 
     bool empty() const {
-        return root == NULL;
+        return root == NIL;
     }
 
     size_t size() const {
         return numNodes;
     }
 
+    // bytes held by the node pool, key table and frozen form, including slack capacity
+    size_t memoryFootprint() const {
+        return nodes.capacity() * sizeof(Node) + keyStore.capacity() * sizeof(key_type)
+            + frozenEntries.capacity() * sizeof(FrozenEntry)
+            + frozenCands.capacity() * sizeof(FrozenCand);
+    }
+
+    /**
+     * Writes a layout and memory report for the current table: byte totals
+     * per pool including slack capacity, data versus glue node split,
+     * per-level node counts, candidate stack utilization against the
+     * Traits::MAX_CANDIDATES bound, and two uniform-query estimates -
+     * expected nodes touched per lookup (each node is reached with
+     * probability 2^-level, one halving per branch above it) and the set
+     * of nodes a million such lookups would pull in, i.e. those with
+     * reach probability above 1e-6. Same `name value` / `name bucket
+     * value` line format as dumpStats(), zero buckets omitted.
+     */
+    void dumpMemReport(std::ostream& os) const {
+        os << "nodes " << numNodes << "\n";
+        os << "free_nodes " << numFree << "\n";
+        os << "node_bytes " << nodes.capacity() * sizeof(Node) << "\n";
+        os << "node_slack_bytes " << (nodes.capacity() - nodes.size()) * sizeof(Node) << "\n";
+        os << "key_bytes " << keyStore.capacity() * sizeof(key_type) << "\n";
+        os << "frozen_bytes " << frozenEntries.capacity() * sizeof(FrozenEntry)
+            + frozenCands.capacity() * sizeof(FrozenCand) << "\n";
+        os << "total_bytes " << memoryFootprint() << "\n";
+
+        if (root == NIL)
+            return;
+
+        const Node* pool = nodeBase();
+
+        size_t dataNodes = 0, glueNodes = 0;
+        size_t leaves = 0, candMax = 0;
+        uint64_t candSum = 0;
+        double expectedTouched = 0.0;
+        size_t hotNodes = 0;        // reach probability >= 2^-20, ~1e-6
+        std::vector<uint64_t> levelHist;
+
+        struct WalkItem { uint32_t node; uint32_t level; uint32_t cands; };
+        std::vector<WalkItem> stack;
+        WalkItem start = { root, 0, 0 };
+        stack.push_back(start);
+        while (!stack.empty()) {
+            WalkItem item = stack.back();
+            stack.pop_back();
+
+            const Node& nd = pool[item.node];
+            if (nd.keyRef != NIL) {
+                dataNodes++;
+                item.cands++;
+            } else {
+                glueNodes++;
+            }
+
+            if (item.level >= levelHist.size())
+                levelHist.resize(item.level + 1);
+            levelHist[item.level]++;
+            expectedTouched += std::pow(0.5, static_cast<double>(item.level));
+            if (item.level <= 20)
+                hotNodes++;
+
+            if (nd.left == NIL && nd.right == NIL) {
+                leaves++;
+                candSum += item.cands;
+                if (item.cands > candMax)
+                    candMax = item.cands;
+                continue;
+            }
+            if (nd.left != NIL) {
+                WalkItem next = { nd.left, item.level + 1, item.cands };
+                stack.push_back(next);
+            }
+            if (nd.right != NIL) {
+                WalkItem next = { nd.right, item.level + 1, item.cands };
+                stack.push_back(next);
+            }
+        }
+
+        os << "data_nodes " << dataNodes << "\n";
+        os << "glue_nodes " << glueNodes << "\n";
+        for (size_t i = 0; i < levelHist.size(); i++) {
+            if (levelHist[i])
+                os << "level_nodes " << i << " " << levelHist[i] << "\n";
+        }
+        os << "cand_bound " << Traits::MAX_CANDIDATES << "\n";
+        os << "cand_max " << candMax << "\n";
+        os << "cand_avg " << (leaves ? static_cast<double>(candSum) / leaves : 0.0) << "\n";
+        os << "expected_touched " << expectedTouched << "\n";
+        os << "working_set_1m_nodes " << hotNodes << "\n";
+        os << "working_set_1m_bytes " << hotNodes * sizeof(Node) << "\n";
+    }
+
+#ifdef LPM_STATS
+    /**
+     * Lookup counters kept when built with -DLPM_STATS, so table shape
+     * changes can be correlated with latency shifts. Histograms are indexed
+     * by the measured quantity, e.g. depthHist[d] counts searches that
+     * stopped at bit depth d. Mutable member so const searchBest() can
+     * account into it; the flag is off in production builds, keeping the
+     * hot path untouched.
+     */
+    struct Stats
+    {
+        Stats() { reset(); }
+
+        void reset() {
+            std::memset(this, 0, sizeof(*this));
+        }
+
+        uint64_t searches;                  // searchBest() calls
+        uint64_t inserts;                   // lookupNode() calls
+        uint64_t dataTouched;               // data nodes met during descents
+        uint64_t glueTouched;               // glue nodes met during descents
+        uint64_t depthHist[Traits::MAX_DEPTH + 2];      // bit depth where descent stopped
+        uint64_t touchedHist[Traits::MAX_DEPTH + 2];    // pool nodes visited per search
+        uint64_t candHist[Traits::MAX_DEPTH + 2];       // candidate stack entries used
+        uint64_t insertTouchedHist[Traits::MAX_DEPTH + 2];  // nodes visited per lookupNode()
+    };
+
+    const Stats& stats() const {
+        return lookupStats;
+    }
+
+    void resetStats() {
+        lookupStats.reset();
+    }
+
+    /**
+     * Writes the counters as `name value` and `name bucket value` lines,
+     * one fact per line and zero buckets omitted, so the report can be
+     * diffed or fed to plotting scripts directly.
+     */
+    void dumpStats(std::ostream& os) const {
+        os << "searches " << lookupStats.searches << "\n";
+        os << "inserts " << lookupStats.inserts << "\n";
+        os << "data_touched " << lookupStats.dataTouched << "\n";
+        os << "glue_touched " << lookupStats.glueTouched << "\n";
+        for (size_t i = 0; i < Traits::MAX_DEPTH + 2; i++) {
+            if (lookupStats.depthHist[i])
+                os << "depth " << i << " " << lookupStats.depthHist[i] << "\n";
+        }
+        for (size_t i = 0; i < Traits::MAX_DEPTH + 2; i++) {
+            if (lookupStats.touchedHist[i])
+                os << "touched " << i << " " << lookupStats.touchedHist[i] << "\n";
+        }
+        for (size_t i = 0; i < Traits::MAX_DEPTH + 2; i++) {
+            if (lookupStats.candHist[i])
+                os << "cand " << i << " " << lookupStats.candHist[i] << "\n";
+        }
+        for (size_t i = 0; i < Traits::MAX_DEPTH + 2; i++) {
+            if (lookupStats.insertTouchedHist[i])
+                os << "insert_touched " << i << " " << lookupStats.insertTouchedHist[i] << "\n";
+        }
+    }
+#endif	/* LPM_STATS */
+
+    void insert(const key_type& key, const mapped_type& value) {
+        (*this)[key] = value;
+    }
+
     mapped_type& operator[](const key_type& key) {
-        Node* node = lookupNode(key);
-        if (node)
-            return node->data;
+        uint32_t node = lookupNode(key);
+        if (node != NIL)
+            return nodes[node].data;
         else
             throw std::out_of_range("BinaryTrie::operator[]: failed inserting key into trie");
     }
 
     mapped_type& at(const key_type& key) {
-        Node* node = searchExact(key);
-        if (node)
-            return node->data;
+        uint32_t node = searchExact(key);
+        if (node != NIL)
+            return const_cast<Node*>(nodeBase())[node].data;
         else
             throw std::out_of_range("BinaryTrie::at: no such key in trie");
     }
 
     mapped_type& best(const key_type& key) {
-        Node* node = searchBest(key);
-        if (node)
-            return node->data;
+        // frozen form resolves full length keys without touching the trie
+        if (!frozenEntries.empty() && key.size() == Traits::MAX_DEPTH) {
+            mapped_type* found = frozenSearch(key);
+            if (found != NULL)
+                return *found;
+            throw std::out_of_range("BinaryTrie::best: no prefixes in trie for given key");
+        }
+
+        uint32_t node = searchBest(key);
+        if (node != NIL)
+            return const_cast<Node*>(nodeBase())[node].data;
         else
             throw std::out_of_range("BinaryTrie::best: no prefixes in trie for given key");
     }
 
+    /**
+     * best() without the exception on a miss. On default-route-free tables
+     * a fair share of queries matches nothing, and a throw/unwind per miss
+     * costs orders of magnitude more than the lookup itself. Returns false
+     * and leaves value untouched when no prefix covers the key.
+     */
+    bool tryBest(const key_type& key, mapped_type& value) {
+        if (!frozenEntries.empty() && key.size() == Traits::MAX_DEPTH) {
+            mapped_type* found = frozenSearch(key);
+            if (found == NULL)
+                return false;
+            value = *found;
+            return true;
+        }
+
+        uint32_t node = searchBest(key);
+        if (node == NIL)
+            return false;
+        value = nodeBase()[node].data;
+        return true;
+    }
+
+    /// at() without the exception; returns false when the key is absent
+    bool tryAt(const key_type& key, mapped_type& value) {
+        uint32_t node = searchExact(key);
+        if (node == NIL)
+            return false;
+        value = nodeBase()[node].data;
+        return true;
+    }
+
+    /**
+     * tryBest() that additionally reports the range the answer is constant
+     * over. When the match lands on a leaf node - nothing more specific
+     * exists below it - every address sharing its first bits resolves to
+     * the same value, so run is set to that prefix and the caller can
+     * answer nearby addresses with a single key comparison. run is left
+     * empty when no such claim can be made: a miss, or a match on an inner
+     * node whose subtree holds longer prefixes. A /0 leaf is
+     * indistinguishable from the empty run and conservatively not claimed.
+     */
+    bool tryBestRun(const key_type& key, mapped_type& value, key_type& run) {
+        run = key_type();
+
+        uint32_t node = searchBest(key);
+        if (node == NIL)
+            return false;
+
+        const Node* pool = nodeBase();
+        value = pool[node].data;
+        if (pool[node].left == NIL && pool[node].right == NIL) {
+            run = keyBase()[pool[node].keyRef];
+            run.setSize(pool[node].bits);
+        }
+        return true;
+    }
+
+    /**
+     * Converts the trie into an immutable level-compressed form (LC-trie)
+     * that best() then queries: dense subtrees collapse into blocks of
+     * 2^branch entries resolved with one index step, sparse spans are
+     * path-compressed into per-entry skip counts, and each entry links the
+     * chain of prefixes covering it, so lookups need no parent pointers and
+     * no glue-node checks. One key comparison at the end validates the
+     * skipped bits, as in searchBest(). The trie itself stays intact for
+     * at() and bestBatch(), but mutation throws until clear().
+     */
+    void freeze() {
+        if (extNodes)
+            throw std::logic_error("BinaryTrie::freeze: trie is attached to read-only snapshot");
+
+        frozenEntries.clear();
+        frozenCands.clear();
+        if (root == NIL)
+            return;
+
+        struct FreezeItem {
+            uint32_t node;          // subtree root becoming one block
+            uint32_t chain;         // candidate chain above the block
+            uint32_t patchEntry;    // parent entry to link, NIL for root
+            uint32_t fromDepth;     // bits consumed before this block
+        };
+
+        std::deque<FreezeItem> queue;
+        uint32_t rootChain = (nodes[root].keyRef != NIL) ? addFrozenCand(root, NIL) : NIL;
+        FreezeItem whole = { static_cast<uint32_t>(root), rootChain, NIL, 0 };
+        queue.push_back(whole);
+        frozenRootSkip = nodes[root].bits;
+        frozenRootBranch = blockBranch(root);
+
+        while (!queue.empty()) {
+            FreezeItem item = queue.front();
+            queue.pop_front();
+
+            size_t top = nodes[item.node].bits;
+            size_t b = blockBranch(item.node);
+            uint32_t base = static_cast<uint32_t>(frozenEntries.size());
+            frozenEntries.resize(base + (1u << b));
+
+            if (item.patchEntry != NIL) {
+                FrozenEntry& pe = frozenEntries[item.patchEntry];
+                pe.child = base;
+                pe.branch = static_cast<uint16_t>(b);
+                pe.skip = static_cast<uint16_t>(top - item.fromDepth);
+            }
+
+            // controlled expansion: walk the trie once per entry, collecting
+            // the data nodes whose span the entry's bits agree with
+            for (uint32_t e = 0; e < (1u << b); e++) {
+                uint32_t cur = item.node;
+                uint32_t chain = item.chain;
+                size_t depth = top;
+                bool dead = false;
+
+                while (depth < top + b) {
+                    // cur's whole span matched, it covers this entry
+                    if (cur != item.node && depth == nodes[cur].bits && nodes[cur].keyRef != NIL)
+                        chain = addFrozenCand(cur, chain);
+
+                    uint32_t bitVal = (e >> (top + b - 1 - depth)) & 1;
+                    if (nodes[cur].bits > depth) {
+                        // inside a compressed span only one bit pattern exists
+                        if (pathBit(cur, depth) != static_cast<bool>(bitVal)) {
+                            dead = true;
+                            break;
+                        }
+                    } else {
+                        uint32_t next = bitVal ? nodes[cur].right : nodes[cur].left;
+                        if (next == NIL) {
+                            dead = true;
+                            break;
+                        }
+                        cur = next;
+                    }
+                    depth++;
+                }
+
+                FrozenEntry& ent = frozenEntries[base + e];
+                if (dead) {
+                    ent.cand = chain;
+                    continue;
+                }
+
+                // cur continues at or below the block boundary
+                if (nodes[cur].keyRef != NIL)
+                    chain = addFrozenCand(cur, chain);
+                ent.cand = chain;
+
+                if (nodes[cur].left != NIL || nodes[cur].right != NIL) {
+                    FreezeItem sub = { cur, chain, base + e, static_cast<uint32_t>(top + b) };
+                    queue.push_back(sub);
+                }
+            }
+        }
+    }
+
+    /**
+     * Longest-prefix match for n keys at once.
+     *
+     * Advances up to LANES lookups in lockstep and prefetches each lookup's
+     * next node while the other lanes execute, hiding memory latency that a
+     * one-at-a-time best() pays serially. results[i] is written only when
+     * matched[i] is set to true.
+     */
+    void bestBatch(const key_type* keys, mapped_type* results, bool* matched, size_t n) const {
+        static const size_t LANES = Traits::BATCH_LANES;
+        static const size_t MAXCAND = Traits::MAX_CANDIDATES;
+
+        const Node* pool = nodeBase();
+        const key_type* keyPool = keyBase();
+
+        for (size_t base = 0; base < n; base += LANES) {
+            size_t cnt = (n - base < LANES) ? n - base : LANES;
+
+            uint32_t node[LANES];
+            uint32_t cand[LANES][MAXCAND];
+            size_t ncand[LANES];
+            bool done[LANES];
+            size_t running = cnt;
+#ifdef LPM_STATS
+            size_t touched[LANES] = { 0 };
+            size_t depthBits[LANES] = { 0 };
+#endif
+
+            for (size_t i = 0; i < cnt; i++) {
+                node[i] = root;
+                ncand[i] = 0;
+                done[i] = (root == NIL);
+                if (root != NIL)
+                    __builtin_prefetch(&pool[root]);
+                else
+                    running--;
+            }
+
+            // one searchBest step per live lane and round
+            while (running > 0) {
+                for (size_t i = 0; i < cnt; i++) {
+                    if (done[i])
+                        continue;
+
+                    const key_type& key = keys[base + i];
+                    const Node& nd = pool[node[i]];
+
+#ifdef LPM_STATS
+                    touched[i]++;
+                    depthBits[i] = (nd.bits < key.size()) ? nd.bits : key.size();
+                    if (nd.keyRef == NIL)
+                        lookupStats.glueTouched++;
+                    else
+                        lookupStats.dataTouched++;
+#endif
+
+                    if (nd.keyRef != NIL && nd.bits <= key.size())
+                        cand[i][ncand[i]++] = node[i];
+
+                    uint32_t next = NIL;
+                    if (nd.bits < key.size())
+                        next = key[nd.bits] ? nd.right : nd.left;
+
+                    if (next == NIL) {
+                        done[i] = true;
+                        running--;
+                    } else {
+                        node[i] = next;
+                        __builtin_prefetch(&pool[next]);
+                    }
+                }
+            }
+
+#ifdef LPM_STATS
+            for (size_t i = 0; i < cnt; i++) {
+                lookupStats.searches++;
+                lookupStats.depthHist[depthBits[i]]++;
+                lookupStats.touchedHist[touched[i]]++;
+                lookupStats.candHist[ncand[i]]++;
+            }
+#endif
+
+            // one key comparison per lane picks the deepest matching candidate
+            for (size_t i = 0; i < cnt; i++) {
+                matched[base + i] = false;
+                if (ncand[i] == 0)
+                    continue;
+
+                const key_type& key = keys[base + i];
+                const Node& deep = pool[cand[i][ncand[i] - 1]];
+                size_t matchedBits = key.firstDifferentBit(keyPool[deep.keyRef], deep.bits);
+                for (size_t c = ncand[i]; c > 0; c--) {
+                    uint32_t idx = cand[i][c - 1];
+                    if (pool[idx].bits <= matchedBits) {
+                        matched[base + i] = true;
+                        results[base + i] = pool[idx].data;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
     void erase(const key_type& key) {
-        Node* node = searchExact(key);
-        if (node)
-            removeNode(node);
-        else
+        if (!tryErase(key))
             throw std::out_of_range("BinaryTrie::erase: no such key in trie");
     }
+
+    /// erase() without the exception; returns false when nothing was removed
+    bool tryErase(const key_type& key) {
+        uint32_t node = searchExact(key);
+        if (node == NIL)
+            return false;
+        removeNode(node);
+        return true;
+    }
+
+    /**
+     * Calls visit(key, value) for every stored prefix, shorter prefixes
+     * before their extensions and 0-side subtrees before 1-side ones, i.e.
+     * in lexicographic key order. Glue nodes are skipped. Works on the
+     * node-pool form and on an attached snapshot alike; the frozen form
+     * keeps the pool intact, so freeze() doesn't affect it.
+     */
+    template <class Visitor>
+    void forEach(Visitor visit) const {
+        if (root == NIL)
+            return;
+
+        const Node* pool = nodeBase();
+        const key_type* keyPool = keyBase();
+
+        std::vector<uint32_t> stack;
+        stack.push_back(root);
+        while (!stack.empty()) {
+            uint32_t idx = stack.back();
+            stack.pop_back();
+
+            const Node& nd = pool[idx];
+            if (nd.keyRef != NIL)
+                visit(keyPool[nd.keyRef], nd.data);
+            // right below left, so the 0-side pops first
+            if (nd.right != NIL)
+                stack.push_back(nd.right);
+            if (nd.left != NIL)
+                stack.push_back(nd.left);
+        }
+    }
+
+    /**
+     * Inserts or replaces key without blocking concurrent readers.
+     *
+     * Unlike operator[] nothing reachable from the published root is written:
+     * every node on the affected path is rebuilt in fresh pool slots and the
+     * new root is published with one atomic store, so searchBest() in other
+     * threads always runs on a complete old or new trie, never a torn one.
+     * Replaced slots stay readable until synchronizeUpdates() recycles them.
+     *
+     * The pool is never grown here, that would move the node array under
+     * running readers - reserve() must have left enough slack, else
+     * std::runtime_error is thrown.
+     */
+    void updateInsert(const key_type& key, const mapped_type& value) {
+        if (extNodes)
+            throw std::logic_error("BinaryTrie::updateInsert: trie is attached to read-only snapshot");
+        if (!frozenEntries.empty())
+            throw std::logic_error("BinaryTrie::updateInsert: trie is frozen");
+
+        if (root == NIL) {
+            ensureUpdateCapacity(1);
+            uint32_t newNode = allocNode(Node(allocKey(key), key.size()));
+            nodes[newNode].data = value;
+            root = newNode;
+            return;
+        }
+
+        // read-only descent, same plan lookupNode() executes in place
+        size_t bitLen = key.size();
+        uint32_t node = root;
+        while (nodes[node].bits < bitLen || nodes[node].keyRef == NIL) {
+            uint32_t next = key[nodes[node].bits] ? nodes[node].right : nodes[node].left;
+            if (next == NIL)
+                break;
+            node = next;
+        }
+        key_type tmpKey = keyStore[nodes[node].keyRef];
+        size_t checkBit = (nodes[node].bits < bitLen) ? nodes[node].bits : bitLen;
+        size_t diffBit = key.firstDifferentBit(tmpKey, checkBit);
+
+        uint32_t parent = nodes[node].parent;
+        while (parent != NIL && nodes[parent].bits >= diffBit) {
+            node = parent;
+            parent = nodes[node].parent;
+        }
+
+        ensureUpdateCapacity(pathLength(node) + 2);
+
+        if (diffBit == bitLen && nodes[node].bits == bitLen) {
+            // key's position already exists, republish it as data node; the
+            // retired original keeps its own key slot for readers
+            uint32_t copy = allocNode(nodes[node]);
+            nodes[copy].keyRef = allocKey(key);
+            nodes[copy].data = value;
+            replacePath(node, copy);
+            if (nodes[copy].left != NIL)
+                nodes[nodes[copy].left].parent = copy;
+            if (nodes[copy].right != NIL)
+                nodes[nodes[copy].right].parent = copy;
+            retire(node);
+            return;
+        }
+
+        uint32_t newNode = allocNode(Node(allocKey(key), key.size()));
+        nodes[newNode].data = value;
+
+        if (nodes[node].bits == diffBit) {
+            // hang newNode below a copy of current node
+            uint32_t copy = allocNode(nodes[node]);
+            if (nodes[copy].keyRef != NIL)
+                nodes[copy].keyRef = allocKey(keyStore[nodes[copy].keyRef]);
+            nodes[newNode].parent = copy;
+            if (key[nodes[copy].bits])
+                nodes[copy].right = newNode;
+            else
+                nodes[copy].left = newNode;
+            uint32_t keptChild = key[nodes[copy].bits] ? nodes[copy].left : nodes[copy].right;
+            replacePath(node, copy);
+            if (keptChild != NIL)
+                nodes[keptChild].parent = copy;
+            retire(node);
+        } else if (bitLen == diffBit) {
+            // newNode takes current node's place, old node hangs below it
+            if (tmpKey[bitLen])
+                nodes[newNode].right = node;
+            else
+                nodes[newNode].left = node;
+            replacePath(node, newNode);
+            nodes[node].parent = newNode;
+        } else {
+            // paths diverge inside both keys, a glue node splits them
+            uint32_t glue = allocNode(Node());
+            nodes[glue].bits = diffBit;
+            if (key[diffBit]) {
+                nodes[glue].right = newNode;
+                nodes[glue].left = node;
+            } else {
+                nodes[glue].right = node;
+                nodes[glue].left = newNode;
+            }
+            nodes[newNode].parent = glue;
+            replacePath(node, glue);
+            nodes[node].parent = glue;
+        }
+    }
+
+    /**
+     * Withdraws key without blocking concurrent readers, the copy-on-write
+     * counterpart of erase(). Same publication and capacity rules as
+     * updateInsert(). Throws std::out_of_range when key isn't in the trie.
+     */
+    void updateWithdraw(const key_type& key) {
+        if (extNodes)
+            throw std::logic_error("BinaryTrie::updateWithdraw: trie is attached to read-only snapshot");
+        if (!frozenEntries.empty())
+            throw std::logic_error("BinaryTrie::updateWithdraw: trie is frozen");
+
+        uint32_t node = searchExact(key);
+        if (node == NIL)
+            throw std::out_of_range("BinaryTrie::updateWithdraw: no such key in trie");
+
+        uint32_t left = nodes[node].left;
+        uint32_t right = nodes[node].right;
+        uint32_t parent = nodes[node].parent;
+
+        if (left != NIL && right != NIL) {
+            // both subtrees stay, node's copy turns into glue; the withdrawn
+            // key slot stays with the retired original until synchronized
+            ensureUpdateCapacity(pathLength(node) + 1);
+            uint32_t copy = allocNode(nodes[node]);
+            nodes[copy].keyRef = NIL;
+            replacePath(node, copy);
+            nodes[left].parent = copy;
+            nodes[right].parent = copy;
+            retire(node);
+            return;
+        }
+
+        if (left == NIL && right == NIL) {
+            if (parent == NIL) {
+                // this was last node
+                root = NIL;
+                retire(node);
+                return;
+            }
+
+            uint32_t sibling = (nodes[parent].right == node) ? nodes[parent].left : nodes[parent].right;
+            if (nodes[parent].keyRef != NIL) {
+                // parent stays as data node, its copy just loses the child
+                ensureUpdateCapacity(pathLength(parent) + 1);
+                uint32_t copy = allocNode(nodes[parent]);
+                nodes[copy].keyRef = allocKey(keyStore[nodes[copy].keyRef]);
+                if (nodes[copy].right == node)
+                    nodes[copy].right = NIL;
+                else
+                    nodes[copy].left = NIL;
+                replacePath(parent, copy);
+                if (sibling != NIL)
+                    nodes[sibling].parent = copy;
+                retire(parent);
+            } else {
+                // glue parent goes too, sibling takes its place
+                ensureUpdateCapacity(pathLength(parent));
+                replacePath(parent, sibling);
+                retire(parent);
+            }
+            retire(node);
+            return;
+        }
+
+        // node's only child takes its place
+        uint32_t child = (right != NIL) ? right : left;
+        ensureUpdateCapacity(pathLength(node));
+        replacePath(node, child);
+        retire(node);
+    }
+
+    /**
+     * Returns slots retired by update*() to the free list. Call once no
+     * reader can still be traversing a root published before those updates,
+     * the grace period is the caller's to enforce.
+     */
+    void synchronizeUpdates() {
+        for (size_t i = 0; i < retired.size(); i++) {
+            uint32_t idx = retired[i];
+            if (nodes[idx].keyRef != NIL) {
+                freeKey(nodes[idx].keyRef);
+                nodes[idx].keyRef = NIL;
+            }
+            nodes[idx].parent = freeHead;
+            freeHead = idx;
+            numFree++;
+        }
+        retired.clear();
+    }
+
+    /**
+     * Orders keys so that every prefix comes right before its extensions;
+     * buildFrom() requires its input sorted this way.
+     */
+    static bool keyPrefixLess(const key_type& a, const key_type& b) {
+        size_t n = (a.size() < b.size()) ? a.size() : b.size();
+        size_t d = a.firstDifferentBit(b, n);
+        if (d < n)
+            return b[d];    // a < b iff a carries the zero at the first differing bit
+        return a.size() < b.size();
+    }
+
+    /**
+     * Builds whole trie in one pass from prefixes sorted by keyPrefixLess()
+     * with duplicate keys removed, replacing current content. Every subtree
+     * maps to a contiguous input range, so nodes are assembled directly
+     * without the per-insert descent, key comparison and parent walk-back
+     * of lookupNode(), and get written to the pool in BFS order, which is
+     * also the order searchBest() touches them.
+     */
+    void buildFrom(const std::vector<std::pair<key_type, mapped_type> >& prefixes) {
+        clear();
+        if (prefixes.empty())
+            return;
+
+        nodes.reserve(prefixes.size() * 2);
+        keyStore.reserve(prefixes.size());
+
+        struct BuildItem {
+            size_t lo, hi;      // prefix range forming this subtree
+            uint32_t parent;
+            bool rightChild;
+        };
+
+        std::deque<BuildItem> queue;
+        BuildItem whole = { 0, prefixes.size(), NIL, false };
+        queue.push_back(whole);
+
+        while (!queue.empty()) {
+            BuildItem item = queue.front();
+            queue.pop_front();
+
+            // sorted range shares exactly the common prefix of its endpoints
+            const key_type& firstKey = prefixes[item.lo].first;
+            const key_type& lastKey = prefixes[item.hi - 1].first;
+            size_t minLen = (firstKey.size() < lastKey.size()) ? firstKey.size() : lastKey.size();
+            size_t lcp = firstKey.firstDifferentBit(lastKey, minLen);
+
+            uint32_t idx;
+            size_t childLo = item.lo;
+            if (firstKey.size() == lcp) {
+                // shortest key covers whole range, data node
+                idx = allocNode(Node(allocKey(firstKey), lcp));
+                nodes[idx].data = prefixes[item.lo].second;
+                childLo = item.lo + 1;
+            } else {
+                // range diverges below the common prefix, glue node
+                idx = allocNode(Node());
+                nodes[idx].bits = lcp;
+            }
+
+            nodes[idx].parent = item.parent;
+            if (item.parent == NIL)
+                root = idx;
+            else if (item.rightChild)
+                nodes[item.parent].right = idx;
+            else
+                nodes[item.parent].left = idx;
+
+            if (childLo >= item.hi)
+                continue;
+
+            // all remaining keys are longer than lcp, split them on bit lcp
+            size_t a = childLo, b = item.hi;
+            while (a < b) {
+                size_t m = (a + b) / 2;
+                if (prefixes[m].first[lcp])
+                    b = m;
+                else
+                    a = m + 1;
+            }
+
+            if (childLo < a) {
+                BuildItem left = { childLo, a, idx, false };
+                queue.push_back(left);
+            }
+            if (a < item.hi) {
+                BuildItem right = { a, item.hi, idx, true };
+                queue.push_back(right);
+            }
+        }
+    }
+
+    /**
+     * Writes trie as versioned binary snapshot. Since the pool already
+     * addresses nodes by indices the node array is dumped as-is and can be
+     * served straight from a file mapping later, see attachSnapshot().
+     */
+    void writeSnapshot(std::ostream& out) const {
+        SnapshotHeader hdr;
+        hdr.magic = SNAPSHOT_MAGIC;
+        hdr.version = SNAPSHOT_VERSION;
+        hdr.keyBytes = N;
+        hdr.mappedBytes = sizeof(mapped_type);
+        hdr.nodeBytes = sizeof(Node);
+        hdr.keySlotBytes = sizeof(key_type);
+        hdr.root = root;
+        hdr.reserved = 0;
+        hdr.nodeCount = nodes.size();
+        hdr.liveCount = numNodes;
+        hdr.keyCount = keyStore.size();
+
+        out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        if (!nodes.empty())
+            out.write(reinterpret_cast<const char*>(&nodes[0]), nodes.size() * sizeof(Node));
+        if (!keyStore.empty())
+            out.write(reinterpret_cast<const char*>(&keyStore[0]), keyStore.size() * sizeof(key_type));
+    }
+
+    /**
+     * Serves lookups directly from a snapshot mapping without copying nodes.
+     * Mapping must stay valid for the trie lifetime; the trie becomes
+     * read-only until clear(). Returns number of bytes consumed.
+     */
+    size_t attachSnapshot(const unsigned char* data, size_t avail) {
+        SnapshotHeader hdr;
+        if (avail < sizeof(hdr))
+            throw std::runtime_error("BinaryTrie::attachSnapshot: snapshot file truncated");
+        memcpy(&hdr, data, sizeof(hdr));
+
+        if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION)
+            throw std::runtime_error("BinaryTrie::attachSnapshot: not a valid snapshot file");
+        if (hdr.keyBytes != N || hdr.mappedBytes != sizeof(mapped_type)
+            || hdr.nodeBytes != sizeof(Node) || hdr.keySlotBytes != sizeof(key_type))
+            throw std::runtime_error("BinaryTrie::attachSnapshot: snapshot layout doesn't match this build");
+
+        size_t nodeBytes = static_cast<size_t>(hdr.nodeCount) * sizeof(Node);
+        size_t needed = sizeof(hdr) + nodeBytes + static_cast<size_t>(hdr.keyCount) * sizeof(key_type);
+        if (avail < needed)
+            throw std::runtime_error("BinaryTrie::attachSnapshot: snapshot file truncated");
+
+        clear();
+        extNodes = reinterpret_cast<const Node*>(data + sizeof(hdr));
+        extKeys = reinterpret_cast<const key_type*>(data + sizeof(hdr) + nodeBytes);
+        root = hdr.root;
+        numNodes = static_cast<size_t>(hdr.liveCount);
+        return needed;
+    }
 private:
     BinaryTrie(const BinaryTrie&);
     BinaryTrie& operator=(const BinaryTrie&);
 
+    // invalid node index, used where the pointer version used NULL
+    static const uint32_t NIL = 0xffffffffu;
+
+    static const uint32_t SNAPSHOT_MAGIC = 0x4c504d53u;     // "LPMS"
+    static const uint32_t SNAPSHOT_VERSION = 2;
+
+    struct SnapshotHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t keyBytes;      // template argument N
+        uint32_t mappedBytes;   // sizeof(mapped_type)
+        uint32_t nodeBytes;     // sizeof(Node), guards layout drift
+        uint32_t keySlotBytes;  // sizeof(key_type), guards key table layout
+        uint32_t root;
+        uint32_t reserved;
+        uint64_t nodeCount;     // pool slots stored in file
+        uint64_t liveCount;     // live nodes, i.e. size()
+        uint64_t keyCount;      // key table slots stored in file
+    };
+
+    /**
+     * Node holds no key itself, only an index into the key side table -
+     * the key bytes are mostly redundant with the path taken from the root
+     * anyway, and this keeps nodes at 24 bytes so several times more of
+     * them fit a cache line budget than with embedded BitArray copies.
+     */
     struct Node
     {
-        Node() : left(NULL), right(NULL), parent(NULL), bits(0) { }
-        Node(const key_type& key, size_t bits) : left(NULL), right(NULL), parent(NULL), key(key), bits(bits) { }
+        Node() : left(NIL), right(NIL), parent(NIL), keyRef(NIL), bits(0) { }
+        Node(uint32_t keyRef, size_t bits)
+            : left(NIL), right(NIL), parent(NIL), keyRef(keyRef), bits(static_cast<uint32_t>(bits)) { }
 
-        Node *left, *right, *parent;
+        uint32_t left, right, parent;       // indices into node pool
+        uint32_t keyRef;                    // index into key table, NIL for glue nodes
         mapped_type data;
+        uint32_t bits;                      // number of bits in key that's valid for this node
+    };
+
+    /**
+     * Allocates node in pool, reusing free-listed slots from removeNode().
+     * Note that this may reallocate the pool, invalidating Node references.
+     */
+    uint32_t allocNode(const Node& init) {
+        uint32_t idx;
+        if (freeHead != NIL) {
+            idx = freeHead;
+            freeHead = nodes[idx].parent;       // parent links free list
+            nodes[idx] = init;
+            numFree--;
+        } else {
+            idx = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(init);
+        }
+        numNodes++;
+        return idx;
+    }
+
+    void freeNode(uint32_t idx) {
+        if (nodes[idx].keyRef != NIL) {
+            freeKey(nodes[idx].keyRef);
+            nodes[idx].keyRef = NIL;
+        }
+        nodes[idx].parent = freeHead;
+        freeHead = idx;
+        numNodes--;
+        numFree++;
+    }
+
+    // update*() can't reallocate the pool or key table, so demand the slack up front
+    void ensureUpdateCapacity(size_t want) {
+        if (numFree + (nodes.capacity() - nodes.size()) < want
+            || freeKeys.size() + (keyStore.capacity() - keyStore.size()) < want)
+            throw std::runtime_error("BinaryTrie: node pool exhausted, reserve() more slots before updating");
+    }
+
+    size_t pathLength(uint32_t node) const {
+        size_t len = 0;
+        for (uint32_t p = nodes[node].parent; p != NIL; p = nodes[p].parent)
+            len++;
+        return len;
+    }
+
+    // marks a replaced slot readable-but-dead until synchronizeUpdates()
+    void retire(uint32_t idx) {
+        retired.push_back(idx);
+        numNodes--;
+    }
+
+    /**
+     * Publishes newIdx in oldIdx's place: every ancestor of oldIdx is copied
+     * into a fresh slot linking the previous copy, the copied root is stored
+     * atomically and the replaced ancestors retired. Only parent links of
+     * kept nodes are written in place - searches never read those, so
+     * readers on the old root are unaffected. oldIdx itself is left alone,
+     * the caller decides whether it stays reachable.
+     */
+    void replacePath(uint32_t oldIdx, uint32_t newIdx) {
+        uint32_t oldCur = oldIdx;
+        uint32_t newCur = newIdx;
+
+        uint32_t parent = nodes[oldCur].parent;
+        while (parent != NIL) {
+            uint32_t copy = allocNode(nodes[parent]);
+            // the retired original keeps serving readers, so the copy gets
+            // its own key slot instead of sharing one
+            if (nodes[copy].keyRef != NIL)
+                nodes[copy].keyRef = allocKey(keyStore[nodes[copy].keyRef]);
+            if (nodes[copy].right == oldCur)
+                nodes[copy].right = newCur;
+            else
+                nodes[copy].left = newCur;
+            nodes[newCur].parent = copy;
+
+            uint32_t sibling = (nodes[copy].right == newCur) ? nodes[copy].left : nodes[copy].right;
+            if (sibling != NIL)
+                nodes[sibling].parent = copy;
+
+            retire(parent);
+            oldCur = parent;
+            newCur = copy;
+            parent = nodes[oldCur].parent;
+        }
+
+        nodes[newCur].parent = NIL;
+        root = newCur;
+    }
+
+    // node pool for reading, either our own or an attached snapshot mapping.
+    // data() only touches the vector's base pointer, which never moves while
+    // update*() run within reserved capacity, so concurrent readers are safe
+    const Node* nodeBase() const {
+        if (extNodes)
+            return extNodes;
+        return nodes.data();
+    }
+
+    // key side table for reading, same ownership rules as nodeBase()
+    const key_type* keyBase() const {
+        if (extKeys)
+            return extKeys;
+        return keyStore.data();
+    }
+
+    uint32_t allocKey(const key_type& key) {
+        if (!freeKeys.empty()) {
+            uint32_t idx = freeKeys.back();
+            freeKeys.pop_back();
+            keyStore[idx] = key;
+            return idx;
+        }
+        keyStore.push_back(key);
+        return static_cast<uint32_t>(keyStore.size() - 1);
+    }
+
+    void freeKey(uint32_t idx) {
+        freeKeys.push_back(idx);
+    }
+
+    // frozen blocks hold at most 2^MAX_BRANCH entries
+    static const size_t MAX_BRANCH = Traits::MAX_BRANCH;
+
+    struct FrozenCand
+    {
         key_type key;
-        size_t bits;                        // number of bits in key that's valid for this node
+        mapped_type value;
+        uint32_t bits;
+        uint32_t up;            // next shallower candidate on the path, NIL
+    };
+
+    struct FrozenEntry
+    {
+        FrozenEntry() : child(NIL), cand(NIL), branch(0), skip(0) { }
+
+        uint32_t child;         // first entry of child block, NIL at bottom
+        uint32_t cand;          // deepest candidate covering this entry, NIL
+        uint16_t branch;        // bits the child block resolves at once
+        uint16_t skip;          // path compressed bits before the child block
     };
 
-    Node* lookupNode(const key_type& key);
-    Node* searchExact(const key_type& key);
-    Node* searchBest(const key_type& key);
-    void removeNode(Node* node);
+    // caller's allocator rebound to the pool element types
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<key_type> KeyAlloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<FrozenEntry> FrozenEntryAlloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<FrozenCand> FrozenCandAlloc;
+
+    /**
+     * Levels below node forming a complete binary subtree, i.e. how many
+     * bits one block can resolve without manufacturing dead entries.
+     */
+    size_t completeBits(uint32_t node) const {
+        const Node& n = nodes[node];
+        if (n.left == NIL || n.right == NIL)
+            return 0;
+        size_t l = (nodes[n.left].bits == n.bits + 1) ? completeBits(n.left) : 0;
+        size_t r = (nodes[n.right].bits == n.bits + 1) ? completeBits(n.right) : 0;
+        return 1 + ((l < r) ? l : r);
+    }
+
+    size_t blockBranch(uint32_t node) const {
+        size_t b = completeBits(node);
+        if (b == 0)
+            b = 1;
+        return (b > MAX_BRANCH) ? MAX_BRANCH : b;
+    }
+
+    // bit j of the path through node, recovered from any data key in its
+    // subtree (leafs are always data nodes, so the walk terminates)
+    bool pathBit(uint32_t node, size_t j) const {
+        uint32_t dn = node;
+        while (nodes[dn].keyRef == NIL)
+            dn = nodes[dn].left;
+        return keyStore[nodes[dn].keyRef][j];
+    }
+
+    uint32_t addFrozenCand(uint32_t node, uint32_t up) {
+        FrozenCand c;
+        c.key = keyStore[nodes[node].keyRef];
+        c.value = nodes[node].data;
+        c.bits = nodes[node].bits;
+        c.up = up;
+        frozenCands.push_back(c);
+        return static_cast<uint32_t>(frozenCands.size() - 1);
+    }
 
-    Node* root;
+    static uint32_t extractBits(const key_type& key, size_t pos, size_t count) {
+        uint32_t v = 0;
+        for (size_t i = 0; i < count; i++)
+            v = (v << 1) | (key[pos + i] ? 1 : 0);
+        return v;
+    }
+
+    /// frozen-form lookup shared by best() and tryBest(), NULL on a miss
+    mapped_type* frozenSearch(const key_type& key) {
+        uint32_t cand = NIL;
+        uint32_t base = 0;
+        size_t pos = frozenRootSkip;
+        size_t branch = frozenRootBranch;
+
+        while (pos + branch <= key.size()) {
+            const FrozenEntry& e = frozenEntries[base + extractBits(key, pos, branch)];
+            if (e.cand != NIL)
+                cand = e.cand;
+            if (e.child == NIL)
+                break;
+            pos += branch + e.skip;
+            base = e.child;
+            branch = e.branch;
+        }
+
+        if (cand != NIL) {
+            // skipped bits were never checked on the way down; one comparison
+            // against the deepest candidate validates the whole path
+            FrozenCand& deep = frozenCands[cand];
+            size_t checkBits = (deep.bits < key.size()) ? deep.bits : key.size();
+            size_t matchedBits = key.firstDifferentBit(deep.key, checkBits);
+            for (uint32_t c = cand; c != NIL; c = frozenCands[c].up) {
+                if (frozenCands[c].bits <= matchedBits)
+                    return &frozenCands[c].value;
+            }
+        }
+        return NULL;
+    }
+
+    uint32_t lookupNode(const key_type& key);
+    uint32_t searchExact(const key_type& key) const;
+    uint32_t searchBest(const key_type& key) const;
+    void removeNode(uint32_t node);
+
+    std::vector<Node, NodeAlloc> nodes;     // contiguous node pool addressed by 32bit indices
+    std::vector<FrozenEntry, FrozenEntryAlloc> frozenEntries;   // level compressed blocks built by freeze()
+    std::vector<FrozenCand, FrozenCandAlloc> frozenCands;       // prefix chains referenced by frozen entries
+    size_t frozenRootSkip;      // bits consumed before the root block
+    size_t frozenRootBranch;    // bits the root block resolves at once
+    std::vector<key_type, KeyAlloc> keyStore;   // data node keys, referenced by Node::keyRef
+    std::vector<uint32_t> freeKeys;     // reusable key table slots
+    std::vector<uint32_t> retired;      // slots replaced by update*(), recycled by synchronizeUpdates()
+    std::atomic<uint32_t> root;         // atomic so update*() can publish to running readers
+    uint32_t freeHead;          // head of free list threaded through removed slots
     size_t numNodes;
+    size_t numFree;             // length of the free list
+    const Node* extNodes;       // snapshot node array when attached, else NULL
+    const key_type* extKeys;    // snapshot key table when attached, else NULL
+#ifdef LPM_STATS
+    mutable Stats lookupStats;
+#endif
 };
 
-template <size_t N, class T>
-typename BinaryTrie<N,T>::Node* BinaryTrie<N,T>::lookupNode(const typename BinaryTrie<N,T>::key_type& key) {
+template <size_t N, class T, class Alloc, class Traits>
+uint32_t BinaryTrie<N,T,Alloc,Traits>::lookupNode(const typename BinaryTrie<N,T,Alloc,Traits>::key_type& key) {
+    // snapshot mappings are read-only
+    if (extNodes)
+        throw std::logic_error("BinaryTrie::lookupNode: trie is attached to read-only snapshot");
+    // the frozen form wouldn't reflect the change
+    if (!frozenEntries.empty())
+        throw std::logic_error("BinaryTrie::lookupNode: trie is frozen");
+
     // if we don't have root yet create it.
-    if (root == NULL) {
-        Node* node = new BinaryTrie<N,T>::Node(key, key.size());
-        root = node;
-        numNodes++;
-        return node;
+    if (root == NIL) {
+#ifdef LPM_STATS
+        lookupStats.inserts++;
+        lookupStats.insertTouchedHist[0]++;
+#endif
+        root = allocNode(Node(allocKey(key), key.size()));
+        return root;
     }
 
+#ifdef LPM_STATS
+    size_t touched = 1;     // root
+#endif
+
     // walk to nearest data node. note that leafs are always data nodes.
-    Node* node = root;
+    uint32_t node = root;
     size_t bitLen = key.size();
-    while (node->bits < bitLen || node->key.empty()) {
-        if (key[node->bits]) {
-            if (node->right == NULL)
+    while (nodes[node].bits < bitLen || nodes[node].keyRef == NIL) {
+        if (key[nodes[node].bits]) {
+            if (nodes[node].right == NIL)
                 break;
-            node = node->right;
+            node = nodes[node].right;
         } else {
-            if (node->left == NULL)
+            if (nodes[node].left == NIL)
                 break;
-            node = node->left;
+            node = nodes[node].left;
         }
+#ifdef LPM_STATS
+        touched++;
+        if (nodes[node].keyRef == NIL)
+            lookupStats.glueTouched++;
+        else
+            lookupStats.dataTouched++;
+#endif
     }
     // store node key, which we compare with given key
-    key_type tmpKey = node->key;
+    key_type tmpKey = keyStore[nodes[node].keyRef];
 
     // find first different bit
-    size_t checkBit = (node->bits < bitLen) ? node->bits : bitLen;
-    size_t diffBit = key.firstDifferentBit(node->key, checkBit);
+    size_t checkBit = (nodes[node].bits < bitLen) ? nodes[node].bits : bitLen;
+    size_t diffBit = key.firstDifferentBit(tmpKey, checkBit);
 
     // walk back before different bit
-    Node* parent = node->parent;
-    while (parent && parent->bits >= diffBit) {
+    uint32_t parent = nodes[node].parent;
+    while (parent != NIL && nodes[parent].bits >= diffBit) {
         node = parent;
-        parent = node->parent;
+        parent = nodes[node].parent;
+#ifdef LPM_STATS
+        touched++;
+#endif
     }
 
+#ifdef LPM_STATS
+    lookupStats.inserts++;
+    // walk-back revisits descent nodes, so the count can exceed one path;
+    // everything past the last bucket is clamped into it
+    lookupStats.insertTouchedHist[(touched < Traits::MAX_CANDIDATES) ? touched : Traits::MAX_CANDIDATES]++;
+#endif
+
     // if we are on right node return it
-    if (diffBit == bitLen && node->bits == bitLen) {
+    if (diffBit == bitLen && nodes[node].bits == bitLen) {
         // if this was glue, set prefix
-        if (node->key.empty())
-            node->key = key;
+        if (nodes[node].keyRef == NIL)
+            nodes[node].keyRef = allocKey(key);
         return node;
     }
 
     // create new node
-    Node* newNode = new BinaryTrie<N,T>::Node(key, key.size());
-    numNodes++;
+    uint32_t newNode = allocNode(Node(allocKey(key), key.size()));
 
-    if (node->bits == diffBit) {
+    if (nodes[node].bits == diffBit) {
         // put newNode after current node
-        newNode->parent = node;
-        if (key[node->bits])
-            node->right = newNode;
+        nodes[newNode].parent = node;
+        if (key[nodes[node].bits])
+            nodes[node].right = newNode;
         else
-            node->left = newNode;
+            nodes[node].left = newNode;
         return newNode;
     }
 
@@ -184,193 +1332,226 @@ typename BinaryTrie<N,T>::Node* BinaryTrie<N,T>::lookupNode(const typename Binar
         // put newNode before current node
 
         if (tmpKey[bitLen])
-            newNode->right = node;
+            nodes[newNode].right = node;
         else
-            newNode->left = node;
+            nodes[newNode].left = node;
 
-        newNode->parent = node->parent;
-        if (node->parent == NULL)
+        uint32_t nodeParent = nodes[node].parent;
+        nodes[newNode].parent = nodeParent;
+        if (nodeParent == NIL)
             root = newNode;
-        else if (node->parent->right == node)
-            node->parent->right = newNode;
+        else if (nodes[nodeParent].right == node)
+            nodes[nodeParent].right = newNode;
         else
-            node->parent->left = newNode;
+            nodes[nodeParent].left = newNode;
 
-        node->parent = newNode;
+        nodes[node].parent = newNode;
     } else {
         // put newNode next to current node
 
         // create glue node
-        Node* glue = new BinaryTrie<N,T>::Node();
-        glue->bits = diffBit;
-        glue->parent = node->parent;
-        numNodes++;
+        uint32_t glue = allocNode(Node());
+        nodes[glue].bits = diffBit;
+        uint32_t nodeParent = nodes[node].parent;
+        nodes[glue].parent = nodeParent;
 
         if (key[diffBit]) {
-            glue->right = newNode;
-            glue->left = node;
+            nodes[glue].right = newNode;
+            nodes[glue].left = node;
         } else {
-            glue->right = node;
-            glue->left = newNode;
+            nodes[glue].right = node;
+            nodes[glue].left = newNode;
         }
 
-        newNode->parent = glue;
+        nodes[newNode].parent = glue;
 
-        if (node->parent == NULL)
+        if (nodeParent == NIL)
             root = glue;
-        else if (node->parent->right == node)
-            node->parent->right = glue;
+        else if (nodes[nodeParent].right == node)
+            nodes[nodeParent].right = glue;
         else
-            node->parent->left = glue;
+            nodes[nodeParent].left = glue;
 
-        node->parent = glue;
+        nodes[node].parent = glue;
     }
 
     return newNode;
 }
 
-template <size_t N, class T>
-typename BinaryTrie<N,T>::Node* BinaryTrie<N,T>::searchExact(const typename BinaryTrie<N,T>::key_type& key) {
+template <size_t N, class T, class Alloc, class Traits>
+uint32_t BinaryTrie<N,T,Alloc,Traits>::searchExact(const typename BinaryTrie<N,T,Alloc,Traits>::key_type& key) const {
     // on empty trie don't bother
-    if (root == NULL)
-        return NULL;
+    if (root == NIL)
+        return NIL;
+
+    const Node* pool = nodeBase();
 
     // walk trie until we find node with key size >= given key size
-    Node* node = root;
-    while (node->bits < key.size()) {
-        if (key[node->bits])
-            node = node->right;
+    uint32_t node = root;
+    while (pool[node].bits < key.size()) {
+        if (key[pool[node].bits])
+            node = pool[node].right;
         else
-            node = node->left;
+            node = pool[node].left;
 
         // on trie bottom we know that node with given key doesn't exists
-        if (node == NULL)
-            return NULL;
+        if (node == NIL)
+            return NIL;
     }
 
     // node must have right key size and must be data node
-    if (node->bits > key.size() || node->key.empty())
-        return NULL;
+    if (pool[node].bits > key.size() || pool[node].keyRef == NIL)
+        return NIL;
 
-    if (key.compareBits(node->key, key.size()))
+    if (key.compareBits(keyBase()[pool[node].keyRef], key.size()))
         return node;
 
-    return NULL;
+    return NIL;
 }
 
-template <size_t N, class T>
-typename BinaryTrie<N,T>::Node* BinaryTrie<N,T>::searchBest(const typename BinaryTrie<N,T>::key_type& key) {
+template <size_t N, class T, class Alloc, class Traits>
+uint32_t BinaryTrie<N,T,Alloc,Traits>::searchBest(const typename BinaryTrie<N,T,Alloc,Traits>::key_type& key) const {
     // on empty trie don't bother
-    if (root == NULL)
-        return NULL;
-
-    Node* stack[N * 8 + 1];     // stack for storing nodes that are prefix of given key
-    int cnt = 0;            // stack counter
-
-    // walk trie until we find node with key size >= given key size or hit bottom
-    Node* node = root;
-    while (node->bits < key.size()) {
-        // store data nodes to stack
-        if (!node->key.empty())
-            stack[cnt++] = node;
-
-        if (key[node->bits])
-            node = node->right;
+    if (root == NIL)
+        return NIL;
+
+    const Node* pool = nodeBase();
+    const key_type* keyPool = keyBase();
+
+    // collect data nodes met on the way down; the descent itself only needs
+    // branch bits, the key table is touched once at the very end
+    uint32_t cand[Traits::MAX_CANDIDATES];
+    size_t ncand = 0;
+
+#ifdef LPM_STATS
+    size_t touched = 0;
+    size_t depthBits = 0;
+#endif
+
+    uint32_t node = root;
+    while (node != NIL) {
+        const Node& n = pool[node];
+
+#ifdef LPM_STATS
+        touched++;
+        depthBits = (n.bits < key.size()) ? n.bits : key.size();
+        if (n.keyRef == NIL)
+            lookupStats.glueTouched++;
         else
-            node = node->left;
+            lookupStats.dataTouched++;
+#endif
+
+        if (n.keyRef != NIL && n.bits <= key.size())
+            cand[ncand++] = node;
 
-        if (node == NULL)
+        if (n.bits >= key.size())
             break;
-    }
 
-    // store also current data node
-    if (node && !node->key.empty())
-        stack[cnt++] = node;
+        node = key[n.bits] ? n.right : n.left;
+    }
 
-    // go through stack are test keys if they are equal. cuz its stack
-    // longest matching prefix will be found.
-    while (--cnt >= 0) {
-        node = stack[cnt];
-        if (key.compareBits(node->key, node->key.size()) && node->key.size() <= key.size())
-            return node;
+#ifdef LPM_STATS
+    lookupStats.searches++;
+    lookupStats.depthHist[depthBits]++;
+    lookupStats.touchedHist[touched]++;
+    lookupStats.candHist[ncand]++;
+#endif
+
+    if (ncand == 0)
+        return NIL;
+
+    // first deep.bits bits of the deepest candidate's key are exactly the
+    // path walked, so one comparison tells how far the key really followed
+    // it - the deepest candidate at or above that depth is the match
+    const Node& deep = pool[cand[ncand - 1]];
+    size_t matched = key.firstDifferentBit(keyPool[deep.keyRef], deep.bits);
+    while (ncand > 0) {
+        if (pool[cand[ncand - 1]].bits <= matched)
+            return cand[ncand - 1];
+        ncand--;
     }
 
-    return NULL;
+    return NIL;
 }
 
-template <size_t N, class T>
-void BinaryTrie<N,T>::removeNode(typename BinaryTrie<N,T>::Node* node) {
+template <size_t N, class T, class Alloc, class Traits>
+void BinaryTrie<N,T,Alloc,Traits>::removeNode(uint32_t node) {
+    // snapshot mappings are read-only
+    if (extNodes)
+        throw std::logic_error("BinaryTrie::removeNode: trie is attached to read-only snapshot");
+    // the frozen form wouldn't reflect the change
+    if (!frozenEntries.empty())
+        throw std::logic_error("BinaryTrie::removeNode: trie is frozen");
+
     // if node has children
-    if (node->right && node->left) {
-        node->key = key_type();     // set key to empty, this will indicate that node isn't data node
+    if (nodes[node].right != NIL && nodes[node].left != NIL) {
+        // drop key reference, this will indicate that node isn't data node
+        freeKey(nodes[node].keyRef);
+        nodes[node].keyRef = NIL;
         return;
     }
     // when node is leaf
-    if (node->right == NULL && node->left == NULL) {
-        Node* parent = node->parent;
-        delete node;
-        numNodes--;
+    if (nodes[node].right == NIL && nodes[node].left == NIL) {
+        uint32_t parent = nodes[node].parent;
+        freeNode(node);
 
         // this was last node
-        if (parent == NULL) {
-            root = NULL;
-            delete node;
+        if (parent == NIL) {
+            root = NIL;
             return;
         }
 
         // get another parent child, aka node's sibling
-        Node* child;
-        if (parent->right == node) {
-            parent->right = NULL;
-            child = parent->left;
+        uint32_t child;
+        if (nodes[parent].right == node) {
+            nodes[parent].right = NIL;
+            child = nodes[parent].left;
         } else {
-            parent->left = NULL;
-            child = parent->right;
+            nodes[parent].left = NIL;
+            child = nodes[parent].right;
         }
 
         // if parent is data node we are finished
-        if (!parent->key.empty())
+        if (nodes[parent].keyRef != NIL)
             return;
 
         // otherwise we need to delete parent too
-        if (parent->parent == NULL)
+        uint32_t grandParent = nodes[parent].parent;
+        if (grandParent == NIL)
             root = child;
-        else if (parent->parent->right == parent)
-            parent->parent->right = child;
+        else if (nodes[grandParent].right == parent)
+            nodes[grandParent].right = child;
         else
-            parent->parent->left = child;
+            nodes[grandParent].left = child;
 
-        child->parent = parent->parent;
-        delete parent;
-        numNodes--;
+        nodes[child].parent = grandParent;
+        freeNode(parent);
         return;
     }
 
     // node has 1 child
 
     // get child
-    Node* child;
-    if (node->right)
-        child = node->right;
+    uint32_t child;
+    if (nodes[node].right != NIL)
+        child = nodes[node].right;
     else
-        child = node->left;
+        child = nodes[node].left;
 
     // link parent
-    Node* parent = node->parent;
-    child->parent = parent;
+    uint32_t parent = nodes[node].parent;
+    nodes[child].parent = parent;
 
-    delete node;
-    numNodes--;
+    freeNode(node);
 
-    if (parent == NULL) {
+    if (parent == NIL) {
         root = child;
         return;
     }
-    if (parent->right == node)
-        parent->right = child;
+    if (nodes[parent].right == node)
+        nodes[parent].right = child;
     else
-        parent->left = child;
+        nodes[parent].left = child;
 }
 
 #endif	/* BINTRIE_H */
-
@@ -11,11 +11,17 @@
 #define	BITARRAY_H
 
 #include <stdexcept>
+#include <iostream>
 #include <cstring>
 #include <climits>
 #include <iterator>
 #include <cassert>
 #include <cstddef>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 template <size_t N>
 class BitArray
@@ -46,6 +52,10 @@ public:
 	unsigned char* internalStorage() {
 		return bits;
 	}
+
+	const unsigned char* internalStorage() const {
+		return bits;
+	}
 	
 	void setSize(size_t nbits) {
 		assert(nbits <= byteSize() * WORD_BITS);
@@ -85,18 +95,18 @@ public:
     }
 
     size_t firstDifferentBit(const BitArray& other, size_t n) const {
-        size_t result = 0;
-        for (size_t i = 0; i * 8 < n; i++) {
-            unsigned int r;
-            if ((r = bits[i] ^ other.bits[i]) == 0) {
-                result = (i + 1) * 8;
-                continue;
+        size_t numBytes = getByteCount(n);
+        size_t result = n;
+
+        // compare up to 8 bytes per iteration instead of one
+        for (size_t i = 0; i < numBytes; ) {
+            size_t chunk = (numBytes - i < 8) ? numBytes - i : 8;
+            uint64_t r = loadWord(bits + i, chunk) ^ loadWord(other.bits + i, chunk);
+            if (r != 0) {
+                result = i * 8 + __builtin_clzll(r);
+                break;
             }
-
-            // clz works on int so we need to fit result for char.
-            // r is guaranteed to have one's only in last byte
-            result = i * 8 + (__builtin_clz(r) - (sizeof(int) - sizeof(char)) * 8);
-            break;
+            i += chunk;
         }
 
         if (result > n)
@@ -112,6 +122,24 @@ public:
         size_t n = nbits / WORD_BITS;
         size_t offset = nbits % WORD_BITS;
 
+        // keys fitting one machine word (IPv4) compare as single XOR+shift
+        if (N <= 8) {
+            if (nbits == 0)
+                return true;
+            uint64_t diff = loadWord(bits, N) ^ loadWord(other.bits, N);
+            return (diff >> (64 - nbits)) == 0;
+        }
+
+#ifdef __SSE2__
+        if (N == 16) {
+            // whole 16B key in one vector compare, mask selects compared bytes
+            __m128i lhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bits));
+            __m128i rhs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(other.bits));
+            unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(lhs, rhs)) ^ 0xffffu;
+            if (diff & ((1u << n) - 1))
+                return false;
+        } else
+#endif
         if (memcmp(bits, other.bits, n) != 0)
             return false;
 
@@ -127,10 +155,52 @@ public:
         return true;
     }
 
+    /**
+     * Compares bit range [from, nbits) with other array.
+     * Lets callers that already verified a common prefix check only the
+     * newly added bits instead of rescanning from bit 0.
+     */
+    bool compareBits(const BitArray& other, size_t from, size_t nbits) const {
+        if (nbits > bitCount || nbits > other.bitCount)
+            return false;
+        if (from >= nbits)
+            return true;
+
+        // single word covers whole key for IPv4, compare the range directly
+        if (N <= 8) {
+            uint64_t diff = loadWord(bits, N) ^ loadWord(other.bits, N);
+            return ((diff << from) >> (64 - (nbits - from))) == 0;
+        }
+
+        size_t i = from / WORD_BITS;
+        size_t n = nbits / WORD_BITS;
+        size_t offset = nbits % WORD_BITS;
+
+        storage_type headMask = static_cast<storage_type>(~0) >> (from % WORD_BITS);
+        storage_type tailMask = static_cast<storage_type>((~0) << (WORD_BITS - offset));
+
+        // range within single byte, offset is nonzero here
+        if (i == n)
+            return ((bits[i] ^ other.bits[i]) & headMask & tailMask) == 0;
+
+        if ((bits[i] ^ other.bits[i]) & headMask)
+            return false;
+
+        if (memcmp(bits + i + 1, other.bits + i + 1, n - i - 1) != 0)
+            return false;
+
+        if (offset != 0 && ((bits[n] ^ other.bits[n]) & tailMask))
+            return false;
+
+        return true;
+    }
+
     const_reference operator[](size_t pos) const {
+        // plain shift-and-mask; constructing an iterator plus Reference just
+        // to test one bit showed up in lookup profiles
         size_t n = pos / WORD_BITS;
         size_t offset = pos % WORD_BITS;
-        return *const_iterator(const_cast<storage_type*>(bits) + n, offset);
+        return (bits[n] >> (WORD_BITS - 1 - offset)) & 1;
     }
 
     reference operator[](size_t pos) {
@@ -224,6 +294,20 @@ private:
         return (nbits + 7) >> 3;
     }
 
+    /**
+     * Loads up to 8 storage bytes into one host word so that the first
+     * stored byte ends up most significant, i.e. earlier prefix bits
+     * compare as higher word bits.
+     */
+    static uint64_t loadWord(const storage_type* p, size_t nbytes) {
+        uint64_t word = 0;
+        memcpy(&word, p, nbytes);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        return word;
+    }
+
     static const int WORD_BITS = CHAR_BIT * sizeof(storage_type);
 
     unsigned char bits[N];
@@ -0,0 +1,175 @@
+/**
+ * @file dir24.h
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * File with class Dir24Table
+ */
+
+#ifndef DIR24_H
+#define	DIR24_H
+
+#include "bitarray.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * DIR-24-8 full-expansion lookup table for IPv4.
+ *
+ * Prefixes up to /24 are expanded into a 2^24-entry first-level array
+ * indexed by the top 24 address bits; longer prefixes push their /24 slot
+ * into a 256-entry second-level block indexed by the last byte. Lookup is
+ * one array load, or two when the slot has a second level - no trie
+ * structure is walked at all. The price is the fixed first-level table,
+ * allocated lazily on first insert.
+ */
+template <class T>
+class Dir24Table
+{
+public:
+    typedef T mapped_type;
+    typedef BitArray<4> key_type;
+
+    Dir24Table() : numPrefixes(0) { }
+
+    void clear() {
+        std::vector<Entry>().swap(tbl24);
+        std::vector<Entry>().swap(tblLong);
+        numPrefixes = 0;
+    }
+
+    bool empty() const {
+        return numPrefixes == 0;
+    }
+
+    size_t size() const {
+        return numPrefixes;
+    }
+
+    // bytes held by both table levels, including slack capacity
+    size_t memoryFootprint() const {
+        return (tbl24.capacity() + tblLong.capacity()) * sizeof(Entry);
+    }
+
+    void insert(const key_type& key, const mapped_type& value) {
+        if (tbl24.empty())
+            tbl24.resize(TBL24_SIZE);
+
+        uint32_t addr = loadAddr(key);
+        size_t len = key.size();
+        numPrefixes++;
+
+        if (len <= 24) {
+            // expand over covered first-level range
+            uint32_t first = (addr & prefixMask(len)) >> 8;
+            uint32_t count = 1u << (24 - len);
+
+            for (uint32_t i = first; i < first + count; i++) {
+                Entry& e = tbl24[i];
+                if (e.depth == LONG) {
+                    // slot already has a second level, push value below it
+                    Entry* block = &tblLong[e.value * 256];
+                    for (unsigned j = 0; j < 256; j++) {
+                        if (block[j].depth <= len + 1) {
+                            block[j].depth = len + 1;
+                            block[j].value = value;
+                        }
+                    }
+                } else if (e.depth <= len + 1) {
+                    e.depth = len + 1;
+                    e.value = value;
+                }
+            }
+        } else {
+            Entry& e = tbl24[addr >> 8];
+            if (e.depth != LONG) {
+                // break the /24 slot out into a second-level block seeded
+                // with whatever covered it so far
+                uint32_t block = static_cast<uint32_t>(tblLong.size() / 256);
+                tblLong.resize(tblLong.size() + 256, e);
+                e.value = block;
+                e.depth = LONG;
+            }
+
+            Entry* block = &tblLong[e.value * 256];
+            uint32_t first = (addr & prefixMask(len)) & 0xff;
+            uint32_t count = 1u << (32 - len);
+            for (uint32_t j = first; j < first + count; j++) {
+                if (block[j].depth <= len + 1) {
+                    block[j].depth = len + 1;
+                    block[j].value = value;
+                }
+            }
+        }
+    }
+
+    mapped_type& best(const key_type& key) {
+        Entry* e = lookup(key);
+        if (e)
+            return e->value;
+        else
+            throw std::out_of_range("Dir24Table::best: no prefixes in table for given key");
+    }
+
+    /**
+     * Longest-prefix match for n keys at once; same interface as the trie
+     * engines. results[i] is written only when matched[i] is set to true.
+     */
+    void bestBatch(const key_type* keys, mapped_type* results, bool* matched, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (i + 1 < n && !tbl24.empty())
+                __builtin_prefetch(&tbl24[loadAddr(keys[i + 1]) >> 8]);
+
+            Entry* e = lookup(keys[i]);
+            matched[i] = (e != NULL);
+            if (e)
+                results[i] = e->value;
+        }
+    }
+private:
+    Dir24Table(const Dir24Table&);
+    Dir24Table& operator=(const Dir24Table&);
+
+    static const size_t TBL24_SIZE = 1u << 24;
+    // depth is prefix length + 1 so 0 can mean empty; LONG marks a slot
+    // whose value is a second-level block index instead
+    static const uint8_t LONG = 0xff;
+
+    struct Entry
+    {
+        Entry() : value(), depth(0) { }
+
+        mapped_type value;
+        uint8_t depth;
+    };
+
+    static uint32_t loadAddr(const key_type& key) {
+        const unsigned char* b = key.internalStorage();
+        return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+    }
+
+    static uint32_t prefixMask(size_t len) {
+        return len ? (0xffffffffu << (32 - len)) : 0;
+    }
+
+    Entry* lookup(const key_type& key) {
+        if (tbl24.empty())
+            return NULL;
+
+        uint32_t addr = loadAddr(key);
+        Entry* e = &tbl24[addr >> 8];
+        if (e->depth == LONG)
+            e = &tblLong[e->value * 256 + (addr & 0xff)];
+
+        return e->depth ? e : NULL;
+    }
+
+    std::vector<Entry> tbl24;       // 2^24 entries indexed by top 24 bits
+    std::vector<Entry> tblLong;     // 256-entry blocks for prefixes > /24
+    size_t numPrefixes;
+};
+
+#endif	/* DIR24_H */
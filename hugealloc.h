@@ -0,0 +1,117 @@
+/**
+ * @file hugealloc.h
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * File with class HugePageAlloc
+ */
+
+#ifndef HUGEALLOC_H
+#define	HUGEALLOC_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+/**
+ * Allocator backing containers with 2MB-aligned anonymous mappings marked
+ * for transparent huge pages, cutting TLB misses on large trie pools.
+ * With a non-negative node the mapping is additionally bound to that NUMA
+ * node, so lookups running on the same socket never pay the remote-memory
+ * penalty. Both the huge page advice and the binding are best effort -
+ * when the kernel refuses, the mapping still works as plain pages.
+ * Falls back to malloc() where mmap isn't available.
+ *
+ * Meant for the trie pools via BinaryTrie's allocator argument; small
+ * allocations below one huge page are served by malloc() too, mapping
+ * 2MB for every bookkeeping vector would waste more than it saves.
+ */
+template <class T>
+class HugePageAlloc
+{
+public:
+    typedef T value_type;
+
+    explicit HugePageAlloc(int numaNode = -1) : numaNode(numaNode) { }
+
+    template <class U>
+    HugePageAlloc(const HugePageAlloc<U>& other) : numaNode(other.numaNode) { }
+
+    T* allocate(size_t n) {
+        size_t bytes = n * sizeof(T);
+#ifndef WIN32
+        if (bytes >= HUGE_PAGE_SIZE) {
+            size_t len = roundToHugePage(bytes);
+            void* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+            madvise(p, len, MADV_HUGEPAGE);
+#endif
+            bindToNode(p, len);
+            return static_cast<T*>(p);
+        }
+#endif
+        void* p = malloc(bytes);
+        if (p == NULL)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t n) {
+        size_t bytes = n * sizeof(T);
+#ifndef WIN32
+        if (bytes >= HUGE_PAGE_SIZE) {
+            munmap(p, roundToHugePage(bytes));
+            return;
+        }
+#endif
+        free(p);
+    }
+
+    template <class U>
+    bool operator==(const HugePageAlloc<U>& other) const {
+        return numaNode == other.numaNode;
+    }
+
+    template <class U>
+    bool operator!=(const HugePageAlloc<U>& other) const {
+        return numaNode != other.numaNode;
+    }
+
+    int numaNode;       // NUMA node mappings are bound to, -1 for no binding
+private:
+    static const size_t HUGE_PAGE_SIZE = 2u << 20;
+
+    static size_t roundToHugePage(size_t bytes) {
+        return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+
+    void bindToNode(void* p, size_t len) {
+#if defined(__linux__) && defined(__NR_mbind)
+        if (numaNode < 0)
+            return;
+
+        // raw syscall keeps us off libnuma; constant from linux/mempolicy.h
+        static const int MPOL_BIND_POLICY = 2;
+        unsigned long mask = 1ul << numaNode;
+        syscall(__NR_mbind, p, len, MPOL_BIND_POLICY, &mask,
+            static_cast<unsigned long>(numaNode) + 2, 0ul);
+#else
+        (void)p;
+        (void)len;
+#endif
+    }
+};
+
+#endif	/* HUGEALLOC_H */
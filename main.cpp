@@ -10,6 +10,12 @@
 // project headers
 #include "bitarray.h"
 #include "bintrie.h"
+#include "multibittrie.h"
+#include "treebitmap.h"
+#include "poptrie.h"
+#include "hugealloc.h"
+#include "dir24.h"
+#include "revindex.h"
 
 // system headers
 #ifdef WIN32
@@ -32,6 +38,14 @@ extern "C" {
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 // c++ stl headers
@@ -40,105 +54,1351 @@ extern "C" {
 #include <fstream>
 #include <string>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
 #include <stdexcept>
 #include <cassert>
 #include <vector>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
 
+// build with -DLPM_MULTIBIT to trade memory for stride-based lookup speed,
+// -DLPM_TREEBITMAP for stride lookups at near binary-trie memory, or
+// -DLPM_POPTRIE for the succinct 6-bit-stride v6 structure
+#ifdef LPM_MULTIBIT
+typedef MultibitTrie<sizeof(in_addr), int> Subnet4Dict;
+typedef MultibitTrie<sizeof(in6_addr), int> Subnet6Dict;
+#elif defined(LPM_TREEBITMAP)
+typedef TreeBitmapTrie<sizeof(in_addr), int> Subnet4Dict;
+typedef TreeBitmapTrie<sizeof(in6_addr), int> Subnet6Dict;
+#elif defined(LPM_POPTRIE)
+// the wide v6 keys gain the most from the popcount layout, v4 keeps the
+// binary trie with its snapshot-capable frozen form
+typedef BinaryTrie<sizeof(in_addr), int> Subnet4Dict;
+typedef PoptrieTrie<sizeof(in6_addr), int> Subnet6Dict;
+#elif defined(LPM_HUGEPAGES)
+// trie pools on 2MB-advised mappings, optionally NUMA-bound via --numa
+typedef BinaryTrie<sizeof(in_addr), int, HugePageAlloc<char> > Subnet4Dict;
+typedef BinaryTrie<sizeof(in6_addr), int, HugePageAlloc<char> > Subnet6Dict;
+#else
 typedef BinaryTrie<sizeof(in_addr), int> Subnet4Dict;
 typedef BinaryTrie<sizeof(in6_addr), int> Subnet6Dict;
+#endif
 
 typedef Subnet4Dict::key_type Subnet4;
 typedef Subnet6Dict::key_type Subnet6;
 
 /**
- * Converts Ipv4/Ipv6 address from text to numeric representation.
+ * Parses dotted quad Ipv4 address into 4 network order bytes.
+ * @return true when src is a whole well formed address
+ */
+bool parseIPv4Text(const char* src, unsigned char* dst) {
+    for (int i = 0; i < 4; i++) {
+        bool leadingZero = (src[0] == '0' && static_cast<unsigned>(src[1] - '0') <= 9);
+        unsigned octet = 0;
+        int digits = 0;
+        while (digits < 3 && static_cast<unsigned>(*src - '0') <= 9) {
+            octet = octet * 10 + (*src - '0');
+            src++;
+            digits++;
+        }
+        if (digits == 0 || octet > 255 || leadingZero)
+            return false;
+        dst[i] = static_cast<unsigned char>(octet);
+
+        if (i < 3) {
+            if (*src != '.')
+                return false;
+            src++;
+        }
+    }
+    return *src == '\0';
+}
+
+inline int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Parses Ipv6 address into 16 network order bytes. Handles the usual colon
+ * groups, one '::' run compression and an embedded Ipv4 tail.
+ * @return true when src is a whole well formed address
+ */
+bool parseIPv6Text(const char* src, unsigned char* dst) {
+    unsigned char tmp[16];
+    int filled = 0;         // bytes of tmp written so far
+    int zeroRun = -1;       // byte position of the '::' compression
+
+    if (src[0] == ':') {
+        if (src[1] != ':')
+            return false;
+        src += 2;
+        zeroRun = 0;
+        if (*src == '\0') {
+            memset(dst, 0, 16);
+            return true;
+        }
+    }
+
+    for (;;) {
+        const char* group = src;
+        int value = 0, digits = 0, d;
+        while (digits < 4 && (d = hexDigitValue(*src)) >= 0) {
+            value = (value << 4) | d;
+            src++;
+            digits++;
+        }
+        if (digits == 0)
+            return false;
+
+        if (*src == '.') {
+            // embedded Ipv4 tail supplies the last 4 bytes
+            if (filled > 12 || !parseIPv4Text(group, tmp + filled))
+                return false;
+            filled += 4;
+            break;
+        }
+
+        if (filled > 14)
+            return false;
+        tmp[filled++] = static_cast<unsigned char>(value >> 8);
+        tmp[filled++] = static_cast<unsigned char>(value & 0xff);
+
+        if (*src == '\0')
+            break;
+        if (*src != ':')
+            return false;
+        src++;
+        if (*src == ':') {
+            if (zeroRun >= 0)
+                return false;
+            zeroRun = filled;
+            src++;
+            if (*src == '\0')
+                break;
+        } else if (*src == '\0') {
+            return false;   // trailing single colon
+        }
+    }
+
+    if (zeroRun < 0) {
+        if (filled != 16)
+            return false;
+        memcpy(dst, tmp, 16);
+    } else {
+        if (filled >= 16)
+            return false;   // '::' must stand for at least one zero group
+        memcpy(dst, tmp, zeroRun);
+        memset(dst + zeroRun, 0, 16 - filled);
+        memcpy(dst + 16 - (filled - zeroRun), tmp + zeroRun, filled - zeroRun);
+    }
+    return true;
+}
+
+/**
+ * Converts Ipv4/Ipv6 address from text to numeric representation. A single
+ * scan for the first ':' or '.' picks the family, then the matching parser
+ * converts in place - no inet_pton round trips on the per-line path.
  * @param src text representation
  * @param dst4 pointer where v4 numeric representation will be stored
  * @param dst6 pointer where v6 numeric representation will be stored
  * @return address familly
  */
 int convertAddressToNumeric(const char* src, char* dst4, char* dst6) {
-    if (inet_pton(AF_INET, src, dst4) == 1) {
-    	return AF_INET;
-    } else if(inet_pton(AF_INET6, src, dst6) == 1) {
-    	return AF_INET6;
-    }
-    
+    const char* p = src;
+    while (*p && *p != ':' && *p != '.')
+        p++;
+
+    if (*p == ':' && parseIPv6Text(src, reinterpret_cast<unsigned char*>(dst6)))
+        return AF_INET6;
+    if (*p == '.' && parseIPv4Text(src, reinterpret_cast<unsigned char*>(dst4)))
+        return AF_INET;
+
     return -1;
 }
 
-void parseInputFile(const char* fileName, Subnet4Dict& dict4, Subnet6Dict& dict6) {
-    ifstream file(fileName);
-    istringstream iss;
-    string subnet;
-    int as;
+/**
+ * Sorts parsed prefixes into the order buildFrom() expects and keeps the
+ * last value of every duplicate key, matching repeated-insert semantics.
+ */
+template <size_t N>
+void sortAndDedupePrefixes(vector<pair<BitArray<N>, int> >& prefixes) {
+    stable_sort(prefixes.begin(), prefixes.end(),
+        [](const pair<BitArray<N>, int>& a, const pair<BitArray<N>, int>& b) {
+            return BinaryTrie<N, int>::keyPrefixLess(a.first, b.first);
+        });
 
-    if (!file)
-        throw runtime_error("Unable to open input file!");
+    size_t w = 0;
+    for (size_t i = 0; i < prefixes.size(); i++) {
+        if (w > 0 && prefixes[i].first == prefixes[w - 1].first)
+            prefixes[w - 1].second = prefixes[i].second;
+        else
+            prefixes[w++] = prefixes[i];
+    }
+    prefixes.resize(w);
+}
 
-    while (!file.eof()) {
-        file >> subnet >> as;
+// zeroes host bits past the prefix length so keys can be hashed bytewise
+template <size_t N>
+void maskKeyTail(BitArray<N>& key) {
+    size_t len = key.size();
+    unsigned char* b = key.internalStorage();
+    for (size_t i = 0; i < N; i++) {
+        if (i * 8 >= len)
+            b[i] = 0;
+        else if ((i + 1) * 8 > len)
+            b[i] &= 0xff << (8 - (len - i * 8));
+    }
+}
 
-        if (file.bad())
-            throw runtime_error("Some serious error occured while reading input file!");
+/**
+ * ORTC-style prefix minimization run between parsing and load when
+ * --aggregate is given. Two rules are applied until a fixpoint: sibling
+ * prefixes carrying the same value collapse into their parent (two /25s
+ * with one AS become the /24; a differently-valued parent is overwritten,
+ * its own matches were fully shadowed by the pair anyway), and a prefix
+ * whose nearest covering prefix already resolves to the same value is
+ * dropped. The matched AS for every address is unchanged, the table just
+ * gets smaller and shallower before it ever reaches an engine.
+ */
+template <size_t N>
+void aggregatePrefixes(vector<pair<BitArray<N>, int> >& prefixes) {
+    typedef unordered_map<string, int> Bucket;      // masked key bytes -> value
+
+    // bucket by prefix length; assignment keeps the last duplicate,
+    // matching repeated-insert semantics
+    vector<Bucket> byLen(N * 8 + 1);
+    for (size_t i = 0; i < prefixes.size(); i++) {
+        BitArray<N> key = prefixes[i].first;
+        maskKeyTail(key);
+        byLen[key.size()][string(reinterpret_cast<char*>(key.internalStorage()), N)]
+            = prefixes[i].second;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        // merge equal-valued siblings bottom-up; merged parents can then
+        // merge again one level higher within the same sweep
+        for (size_t len = N * 8; len >= 1; len--) {
+            Bucket& cur = byLen[len];
+            for (Bucket::iterator it = cur.begin(); it != cur.end(); ) {
+                size_t byteIdx = (len - 1) / 8;
+                unsigned char bit = 0x80 >> ((len - 1) % 8);
+                if (it->first[byteIdx] & bit) {     // pairs are handled from the 0 side
+                    ++it;
+                    continue;
+                }
 
-        size_t delim = subnet.find_last_of('/');
+                string sibling = it->first;
+                sibling[byteIdx] ^= bit;
+                Bucket::iterator sib = cur.find(sibling);
+                if (sib == cur.end() || sib->second != it->second) {
+                    ++it;
+                    continue;
+                }
+
+                byLen[len - 1][it->first] = it->second;
+                cur.erase(sib);
+                it = cur.erase(it);
+                changed = true;
+            }
+        }
+
+        // drop prefixes shadowed by an identical-valued covering prefix
+        for (size_t len = 1; len <= N * 8; len++) {
+            Bucket& cur = byLen[len];
+            for (Bucket::iterator it = cur.begin(); it != cur.end(); ) {
+                string key = it->first;
+                bool drop = false;
+                for (size_t alen = len; alen-- > 0; ) {
+                    key[alen / 8] &= ~(0x80 >> (alen % 8));
+                    Bucket::iterator anc = byLen[alen].find(key);
+                    if (anc != byLen[alen].end()) {
+                        drop = (anc->second == it->second);
+                        break;      // nearest covering prefix decides
+                    }
+                }
+
+                if (drop) {
+                    it = cur.erase(it);
+                    changed = true;
+                } else
+                    ++it;
+            }
+        }
+    }
+
+    prefixes.clear();
+    for (size_t len = 0; len <= N * 8; len++) {
+        for (Bucket::iterator it = byLen[len].begin(); it != byLen[len].end(); ++it) {
+            BitArray<N> key;
+            memcpy(key.internalStorage(), it->first.data(), N);
+            key.setSize(len);
+            prefixes.push_back(make_pair(key, it->second));
+        }
+    }
+}
+
+// engines without a bulk-build path load parsed prefixes incrementally
+template <class Dict, size_t N>
+void loadParsedPrefixes(Dict& dict, vector<pair<BitArray<N>, int> >& prefixes) {
+    for (size_t i = 0; i < prefixes.size(); i++)
+        dict.insert(prefixes[i].first, prefixes[i].second);
+}
+
+// BinaryTrie is bulk-built from the sorted prefixes in one pass
+template <size_t N, class Alloc, class Traits>
+void loadParsedPrefixes(BinaryTrie<N, int, Alloc, Traits>& dict, vector<pair<BitArray<N>, int> >& prefixes) {
+    sortAndDedupePrefixes(prefixes);
+    dict.buildFrom(prefixes);
+}
+
+/**
+ * Parses one newline-aligned chunk of the route file in place: the '/' of
+ * every "prefix/len as" line is overwritten with a terminator so the
+ * address parser works straight on the mapping, and the length and AS
+ * fields are read with bounded digit loops - no stream or string
+ * allocation anywhere. On a malformed line error is set and parsing stops.
+ */
+void parseRouteChunk(char* p, char* end, vector<pair<Subnet4, int> >& out4,
+        vector<pair<Subnet6, int> >& out6, string& error) {
+    while (p < end) {
+        char* nl = static_cast<char*>(memchr(p, '\n', end - p));
+        char* lineEnd = nl ? nl : end;
+        char* next = nl ? nl + 1 : end;
+
+        while (p < lineEnd && (*p == ' ' || *p == '\t'))
+            p++;
+        if (lineEnd > p && lineEnd[-1] == '\r')
+            lineEnd--;
+        if (p == lineEnd) {         // blank line
+            p = next;
+            continue;
+        }
+
+        char* slash = NULL;
+        for (char* s = lineEnd - 1; s >= p; s--) {
+            if (*s == '/') {
+                slash = s;
+                break;
+            }
+        }
+        if (slash == NULL) {
+            error = "Malformed line in input file!";
+            return;
+        }
+        *slash = '\0';
+
+        const char* t = slash + 1;
         size_t prefixLen = 0;
-        iss.str(subnet.substr(delim + 1));
-        iss.clear();
-        iss >> prefixLen;
-        string prefix = subnet.substr(0, delim);
+        bool lenDigits = false;
+        while (t < lineEnd && static_cast<unsigned>(*t - '0') <= 9) {
+            prefixLen = prefixLen * 10 + (*t - '0');
+            t++;
+            lenDigits = true;
+        }
+        while (t < lineEnd && (*t == ' ' || *t == '\t'))
+            t++;
+        bool negative = (t < lineEnd && *t == '-');
+        if (negative)
+            t++;
+        int as = 0;
+        bool asDigits = false;
+        while (t < lineEnd && static_cast<unsigned>(*t - '0') <= 9) {
+            as = as * 10 + (*t - '0');
+            t++;
+            asDigits = true;
+        }
+        if (!lenDigits || !asDigits) {
+            error = "Malformed line in input file!";
+            return;
+        }
+        if (negative)
+            as = -as;
 
-		Subnet4 addr4;
-		Subnet6 addr6;
-        int family = convertAddressToNumeric(prefix.c_str(), (char*)addr4.internalStorage(), (char*)addr6.internalStorage());
+        Subnet4 addr4;
+        Subnet6 addr6;
+        int family = convertAddressToNumeric(p, (char*)addr4.internalStorage(), (char*)addr6.internalStorage());
 
         if (family == AF_INET && prefixLen <= 32) {
-			addr4.setSize(prefixLen);
-            dict4[addr4] = as;
+            addr4.setSize(prefixLen);
+            out4.push_back(make_pair(addr4, as));
         } else if (family == AF_INET6 && prefixLen <= 128) {
-			addr6.setSize(prefixLen);
-            dict6[addr6] = as;
-        } else
-            throw runtime_error("Unknown Ip address family");
+            addr6.setSize(prefixLen);
+            out6.push_back(make_pair(addr6, as));
+        } else {
+            error = "Unknown Ip address family";
+            return;
+        }
+
+        p = next;
     }
 }
 
-void printAppropriateAs(std::istream& stream, Subnet4Dict& dict4, Subnet6Dict& dict6) {
-	// on each stream line is Ipv4/Ipv6 address in text representation which is maximum 39 characters long.
-    char lineBuf[64];
-    while (stream.getline(lineBuf, 64)) {
-		if (stream.fail())
-			throw runtime_error("Error while reading input Ip addresses");
-	
-        Subnet4 addr4;
-		Subnet6 addr6;
-        int family = convertAddressToNumeric(lineBuf, (char*)addr4.internalStorage(), (char*)addr6.internalStorage());
-        try {
-            int as;
-            if (family == AF_INET) {
-				addr4.setSize(32);
-                as = dict4.best(addr4);
-            } else if (family == AF_INET6) {
-				addr6.setSize(128);
-                as = dict6.best(addr6);
+/**
+ * Loads the route file through a private writable mapping split at newline
+ * boundaries into one chunk per thread; chunks parse concurrently with
+ * parseRouteChunk() and their results concatenate in file order, so
+ * duplicate handling matches the old sequential reader. iostream never
+ * touches the per-route path anymore.
+ */
+template <class Dict4>
+void parseInputFile(const char* fileName, Dict4& dict4, Subnet6Dict& dict6, bool aggregate,
+        size_t numThreads) {
+    char* data = NULL;
+    size_t size = 0;
+#ifdef WIN32
+    // no mmap on mingw, read the file into one private block instead
+    vector<char> fileBuf;
+    FILE* f = fopen(fileName, "rb");
+    if (f == NULL)
+        throw runtime_error("Unable to open input file!");
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    fileBuf.resize(size);
+    if (size && fread(&fileBuf[0], 1, size, f) != size) {
+        fclose(f);
+        throw runtime_error("Some serious error occured while reading input file!");
+    }
+    fclose(f);
+    data = size ? &fileBuf[0] : NULL;
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Unable to open input file!");
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw runtime_error("Some serious error occured while reading input file!");
+    }
+    size = st.st_size;
+    if (size) {
+        // MAP_PRIVATE so the in-place terminators only dirty our copy
+        void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Some serious error occured while reading input file!");
+        }
+        data = static_cast<char*>(m);
+    }
+    close(fd);
+#endif
+
+    size_t nChunks = (numThreads > 1) ? numThreads : 1;
+    vector<char*> bounds(nChunks + 1, data);
+    bounds[nChunks] = data + size;
+    for (size_t c = 1; c < nChunks; c++) {
+        char* b = data + size * c / nChunks;
+        if (b < bounds[c - 1])
+            b = bounds[c - 1];
+        char* nl = static_cast<char*>(memchr(b, '\n', (data + size) - b));
+        bounds[c] = nl ? nl + 1 : data + size;
+    }
+
+    vector<vector<pair<Subnet4, int> > > chunk4(nChunks);
+    vector<vector<pair<Subnet6, int> > > chunk6(nChunks);
+    vector<string> errors(nChunks);
+
+    if (nChunks == 1) {
+        if (size)
+            parseRouteChunk(bounds[0], bounds[1], chunk4[0], chunk6[0], errors[0]);
+    } else {
+        vector<thread> workers;
+        for (size_t c = 0; c < nChunks; c++) {
+            workers.push_back(thread(parseRouteChunk, bounds[c], bounds[c + 1],
+                ref(chunk4[c]), ref(chunk6[c]), ref(errors[c])));
+        }
+        for (size_t c = 0; c < nChunks; c++)
+            workers[c].join();
+    }
+
+#ifndef WIN32
+    if (data)
+        munmap(data, size);
+#endif
+
+    for (size_t c = 0; c < nChunks; c++) {
+        if (!errors[c].empty())
+            throw runtime_error(errors[c]);
+    }
+
+    vector<pair<Subnet4, int> > prefixes4;
+    vector<pair<Subnet6, int> > prefixes6;
+    size_t total4 = 0, total6 = 0;
+    for (size_t c = 0; c < nChunks; c++) {
+        total4 += chunk4[c].size();
+        total6 += chunk6[c].size();
+    }
+    prefixes4.reserve(total4);
+    prefixes6.reserve(total6);
+    for (size_t c = 0; c < nChunks; c++) {
+        prefixes4.insert(prefixes4.end(), chunk4[c].begin(), chunk4[c].end());
+        prefixes6.insert(prefixes6.end(), chunk6[c].begin(), chunk6[c].end());
+    }
+
+    if (aggregate) {
+        aggregatePrefixes(prefixes4);
+        aggregatePrefixes(prefixes6);
+    }
+
+    loadParsedPrefixes(dict4, prefixes4);
+    loadParsedPrefixes(dict6, prefixes6);
+}
+
+#if !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+/**
+ * Maps snapshot file into memory and attaches both tries to it, so startup
+ * skips text parsing and per-node allocation entirely. Mapping stays alive
+ * for the rest of the process. Returns false when file cannot be opened.
+ */
+bool loadSnapshotFile(const char* fileName, Subnet4Dict& dict4, Subnet6Dict& dict6) {
+    const unsigned char* data;
+    size_t size;
+
+#ifdef WIN32
+    // no mmap on mingw, fall back to reading the file into one block
+    FILE* f = fopen(fileName, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* buf = new unsigned char[size];
+    if (fread(buf, 1, size, f) != size)
+        throw runtime_error("Unable to read snapshot file!");
+    fclose(f);
+    data = buf;
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        throw runtime_error("Unable to stat snapshot file!");
+    size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw runtime_error("Unable to mmap snapshot file!");
+    data = static_cast<const unsigned char*>(map);
+#endif
+
+    size_t used = dict4.attachSnapshot(data, size);
+    dict6.attachSnapshot(data + used, size - used);
+    return true;
+}
+
+void saveSnapshotFile(const char* fileName, Subnet4Dict& dict4, Subnet6Dict& dict6) {
+    ofstream file(fileName, ios::binary);
+    if (!file)
+        throw runtime_error("Unable to open snapshot file for writing!");
+
+    dict4.writeSnapshot(file);
+    dict6.writeSnapshot(file);
+
+    if (!file)
+        throw runtime_error("Error while writing snapshot file!");
+}
+#endif	/* !LPM_MULTIBIT && !LPM_TREEBITMAP && !LPM_POPTRIE */
+
+// addresses are looked up in batches so the tries can interleave the
+// traversals and hide node fetch latency
+static const size_t LOOKUP_BATCH = 64;
+
+// stdin is consumed in blocks this big and results flushed in writes about
+// this big, so per-line iostream overhead never enters the lookup loop
+static const size_t IO_BLOCK_SIZE = 1 << 20;
+
+// blocks and result buffers circulating between the pipeline stages of
+// printAppropriateAs(); enough for every stage to hold one plus slack
+static const size_t PIPELINE_DEPTH = 4;
+
+// stdin block buffers keep this many readable bytes past every line's
+// terminating NUL, so the vector parser can load one full window per line
+static const size_t LINE_OVERREAD = 16;
+
+#ifdef __SSE2__
+/**
+ * SSE2 fast path for parseIPv4Text(). A well formed dotted quad is at
+ * most 15 characters, so one unaligned 16 byte load covers the whole
+ * line; vector compares then locate the terminating NUL and classify
+ * every character as digit or dot at once, replacing the per-character
+ * scan, and only the up-to-three digits of each octet are combined
+ * scalar. Accepts exactly the strings parseIPv4Text() accepts. The
+ * caller must guarantee LINE_OVERREAD readable bytes at src - the stdin
+ * block pools are padded for this, the route file mapping is not, so
+ * parseRouteChunk() stays on the scalar parser.
+ */
+bool parseIPv4TextSSE(const char* src, unsigned char* dst) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+
+    unsigned nulMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_setzero_si128()));
+    if (nulMask == 0)
+        return false;       // no terminator in the window, can't be a quad
+    unsigned len = __builtin_ctz(nulMask);
+    if (len < 7)
+        return false;       // "0.0.0.0" is the shortest well formed quad
+
+    unsigned below = (1u << len) - 1;
+    unsigned dotMask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('.'))) & below;
+
+    __m128i value = _mm_sub_epi8(chunk, _mm_set1_epi8('0'));
+    unsigned digitMask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpgt_epi8(value, _mm_set1_epi8(-1)),
+        _mm_cmplt_epi8(value, _mm_set1_epi8(10)))) & below;
+
+    // nothing but digits and exactly three dots up to the terminator
+    if ((dotMask | digitMask) != below || __builtin_popcount(dotMask) != 3)
+        return false;
+
+    unsigned pos = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned end = (i < 3) ? __builtin_ctz(dotMask) : len;
+        unsigned fieldLen = end - pos;
+        if (fieldLen == 0 || fieldLen > 3)
+            return false;
+        if (fieldLen > 1 && src[pos] == '0')
+            return false;
+
+        unsigned octet = 0;
+        for (unsigned j = pos; j < end; j++)
+            octet = octet * 10 + (src[j] - '0');
+        if (octet > 255)
+            return false;
+        dst[i] = static_cast<unsigned char>(octet);
+
+        pos = end + 1;
+        dotMask &= dotMask - 1;     // consume the lowest dot
+    }
+    return true;
+}
+#endif	/* __SSE2__ */
+
+/**
+ * convertAddressToNumeric() for lines from the padded stdin block pools,
+ * where LINE_OVERREAD readable bytes past every terminator make the
+ * vector fast path safe. Everything the fast path rejects - v6, garbage,
+ * any platform without SSE2 - goes through the scalar route unchanged.
+ */
+inline int convertLineToNumeric(const char* src, char* dst4, char* dst6) {
+#ifdef __SSE2__
+    if (parseIPv4TextSSE(src, reinterpret_cast<unsigned char*>(dst4)))
+        return AF_INET;
+#endif
+    return convertAddressToNumeric(src, dst4, dst6);
+}
+
+/**
+ * Reads up to n bytes from stdin in one request, retrying interrupted reads.
+ * Returns 0 only at end of input.
+ */
+size_t readStdinBlock(char* buf, size_t n) {
+#ifdef WIN32
+    size_t got = fread(buf, 1, n, stdin);
+    if (got == 0 && ferror(stdin))
+        throw runtime_error("Error while reading input Ip addresses");
+    return got;
+#else
+    for (;;) {
+        ssize_t got = read(STDIN_FILENO, buf, n);
+        if (got >= 0)
+            return static_cast<size_t>(got);
+        if (errno != EINTR)
+            throw runtime_error("Error while reading input Ip addresses");
+    }
+#endif
+}
+
+/**
+ * Terminates every full line inside buf[0..avail) in place and appends a
+ * pointer to it to lines. Returns offset of the unterminated tail; when
+ * lastBlock is set the tail is emitted as a final line instead.
+ */
+size_t splitLines(char* buf, size_t avail, bool lastBlock, vector<const char*>& lines) {
+    size_t start = 0;
+    while (start < avail) {
+        char* nl = static_cast<char*>(memchr(buf + start, '\n', avail - start));
+        if (!nl)
+            break;
+        *nl = '\0';
+        lines.push_back(buf + start);
+        start = (nl - buf) + 1;
+    }
+    if (lastBlock && start < avail) {
+        // input without trailing newline, tail is still one address
+        buf[avail] = '\0';
+        lines.push_back(buf + start);
+        start = avail;
+    }
+    return start;
+}
+
+// bumped whenever the dictionaries change; LookupCache instances notice the
+// new generation on their next sync() and drop their entries
+static atomic<unsigned> lookupCacheGeneration(1);
+
+void invalidateLookupCaches() {
+    lookupCacheGeneration.fetch_add(1);
+}
+
+/**
+ * Direct-mapped result cache consulted before the lookup engines. Query
+ * streams are heavily Zipf shaped - a few thousand destinations dominate -
+ * so keying on the full address and remembering the resolved AS (or the
+ * absence of one) turns most lookups into a single probe of a 64K-entry
+ * table instead of a trie descent. Entries are padded so none straddles a
+ * cache line and the table itself is line aligned. Each worker thread owns
+ * its caches, so probes need no synchronization; staleness is handled by
+ * the generation counter above, which every mutation of the dictionaries
+ * must bump via invalidateLookupCaches().
+ */
+template <size_t N>
+class LookupCache
+{
+public:
+    LookupCache() : table(NULL), generation(0) { }
+
+    ~LookupCache() {
+        free(table);
+    }
+
+    /// allocates lazily and drops all entries when the generation moved
+    void sync() {
+        unsigned current = lookupCacheGeneration.load(memory_order_acquire);
+        if (generation == current)
+            return;
+
+        if (table == NULL) {
+#ifdef WIN32
+            table = static_cast<Entry*>(malloc(ENTRIES * sizeof(Entry)));
+#else
+            void* p = NULL;
+            if (posix_memalign(&p, 64, ENTRIES * sizeof(Entry)) != 0)
+                p = NULL;
+            table = static_cast<Entry*>(p);
+#endif
+            if (table == NULL)
+                throw bad_alloc();
+        }
+        memset(table, 0, ENTRIES * sizeof(Entry));
+        generation = current;
+    }
+
+    bool probe(const unsigned char* addr, bool& matched, int& as) const {
+        const Entry& e = table[hash(addr) & (ENTRIES - 1)];
+        if (e.state == EMPTY || memcmp(e.addr, addr, N) != 0)
+            return false;
+        matched = (e.state == MATCH);
+        as = e.as;
+        return true;
+    }
+
+    void store(const unsigned char* addr, bool matched, int as) {
+        Entry& e = table[hash(addr) & (ENTRIES - 1)];
+        memcpy(e.addr, addr, N);
+        e.as = as;
+        e.state = matched ? MATCH : NOMATCH;
+    }
+private:
+    LookupCache(const LookupCache&);
+    LookupCache& operator=(const LookupCache&);
+
+    static const size_t ENTRIES = 1u << 16;
+    static const uint8_t EMPTY = 0;
+    static const uint8_t MATCH = 1;
+    static const uint8_t NOMATCH = 2;       // misses are worth caching too
+
+    struct alignas(N <= 4 ? 16 : 32) Entry
+    {
+        unsigned char addr[N];
+        int32_t as;
+        uint8_t state;
+    };
+
+    static uint32_t hash(const unsigned char* addr) {
+        // FNV-1a with a final fold, plenty for a direct-mapped table
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < N; i++) {
+            h ^= addr[i];
+            h *= 16777619u;
+        }
+        return h ^ (h >> 16);
+    }
+
+    Entry* table;
+    unsigned generation;
+};
+
+/**
+ * Run detection for sorted inputs: consecutive stdin lines are often
+ * addresses inside the same prefix, so the last resolved leaf prefix and
+ * its AS are remembered and the next address is first tested for
+ * membership with one firstDifferentBit() call, skipping the descent
+ * entirely. Only leaf prefixes qualify - under an inner node a more
+ * specific prefix could win and membership alone wouldn't prove the
+ * answer. Thread local like the result caches and invalidated the same
+ * way, through lookupCacheGeneration.
+ */
+template <size_t N>
+class RunMemo
+{
+public:
+    RunMemo() : as(0), valid(false), generation(0) { }
+
+    /// drops the memo when the tables were reloaded
+    void sync() {
+        unsigned current = lookupCacheGeneration.load(memory_order_acquire);
+        if (generation != current) {
+            valid = false;
+            generation = current;
+        }
+    }
+
+    bool probe(const BitArray<N>& key, int& value) const {
+        if (!valid || key.firstDifferentBit(prefix, prefix.size()) != prefix.size())
+            return false;
+        value = as;
+        return true;
+    }
+
+    void store(const BitArray<N>& runPrefix, int value) {
+        prefix = runPrefix;
+        as = value;
+        valid = true;
+    }
+private:
+    BitArray<N> prefix;     // leaf prefix the current run sits in
+    int as;
+    bool valid;
+    unsigned generation;
+};
+
+// engines that can't name the covering leaf prefix leave the memo alone
+template <size_t N, class Dict>
+void updateRunMemo(Dict&, const BitArray<N>&, RunMemo<N>&) {
+}
+
+template <size_t N, class Alloc, class Traits>
+void updateRunMemo(BinaryTrie<N, int, Alloc, Traits>& dict, const BitArray<N>& key, RunMemo<N>& memo) {
+    int value;
+    BitArray<N> run;
+    // a stale memo stays usable, its membership test still holds
+    if (dict.tryBestRun(key, value, run) && run.size() > 0)
+        memo.store(run, value);
+}
+
+/**
+ * Resolves count addresses given as C strings and appends one output line
+ * per address to out ("AS number" or "-"). Addresses in the run of the
+ * last resolved leaf prefix or hitting the result cache are answered
+ * directly; the rest run through bestBatch in LOOKUP_BATCH sized groups
+ * per family.
+ */
+template <class Dict4>
+void resolveAddresses(const char* const* addrs, size_t count, Dict4& dict4, Subnet6Dict& dict6, string& out) {
+    static thread_local LookupCache<sizeof(in_addr)> cache4;
+    static thread_local LookupCache<sizeof(in6_addr)> cache6;
+    static thread_local RunMemo<sizeof(in_addr)> run4;
+    static thread_local RunMemo<sizeof(in6_addr)> run6;
+    cache4.sync();
+    cache6.sync();
+    run4.sync();
+    run6.sync();
+    Subnet4 keys4[LOOKUP_BATCH];
+    Subnet6 keys6[LOOKUP_BATCH];
+    int results4[LOOKUP_BATCH], results6[LOOKUP_BATCH];
+    bool matched4[LOOKUP_BATCH], matched6[LOOKUP_BATCH];
+    int family[LOOKUP_BATCH];           // per line address family
+    size_t slot[LOOKUP_BATCH];          // per line index into its family batch
+    bool cached[LOOKUP_BATCH];          // line was answered by the cache
+    bool cachedMatched[LOOKUP_BATCH];
+    int cachedAs[LOOKUP_BATCH];
+
+    for (size_t base = 0; base < count; base += LOOKUP_BATCH) {
+        size_t lines = (count - base < LOOKUP_BATCH) ? count - base : LOOKUP_BATCH;
+        size_t n4 = 0, n6 = 0;
+
+        for (size_t i = 0; i < lines; i++) {
+            family[i] = convertLineToNumeric(addrs[base + i], (char*)keys4[n4].internalStorage(), (char*)keys6[n6].internalStorage());
+
+            cached[i] = false;
+            if (family[i] == AF_INET) {
+                if (run4.probe(keys4[n4], cachedAs[i])) {
+                    cached[i] = true;
+                    cachedMatched[i] = true;
+                    continue;
+                }
+                if (cache4.probe(keys4[n4].internalStorage(), cachedMatched[i], cachedAs[i])) {
+                    cached[i] = true;
+                    continue;
+                }
+                keys4[n4].setSize(32);
+                slot[i] = n4++;
+            } else if (family[i] == AF_INET6) {
+                if (run6.probe(keys6[n6], cachedAs[i])) {
+                    cached[i] = true;
+                    cachedMatched[i] = true;
+                    continue;
+                }
+                if (cache6.probe(keys6[n6].internalStorage(), cachedMatched[i], cachedAs[i])) {
+                    cached[i] = true;
+                    continue;
+                }
+                keys6[n6].setSize(128);
+                slot[i] = n6++;
+            }
+        }
+
+        dict4.bestBatch(keys4, results4, matched4, n4);
+        dict6.bestBatch(keys6, results6, matched6, n6);
+
+        for (size_t j = 0; j < n4; j++)
+            cache4.store(keys4[j].internalStorage(), matched4[j], matched4[j] ? results4[j] : 0);
+        for (size_t j = 0; j < n6; j++)
+            cache6.store(keys6[j].internalStorage(), matched6[j], matched6[j] ? results6[j] : 0);
+
+        // remember the run around the newest resolved address of each family
+        if (n4 > 0)
+            updateRunMemo(dict4, keys4[n4 - 1], run4);
+        if (n6 > 0)
+            updateRunMemo(dict6, keys6[n6 - 1], run6);
+
+        char numBuf[16];
+        for (size_t i = 0; i < lines; i++) {
+            bool matched;
+            int as = 0;
+            if (cached[i]) {
+                matched = cachedMatched[i];
+                as = cachedAs[i];
+            } else if (family[i] == AF_INET) {
+                matched = matched4[slot[i]];
+                if (matched)
+                    as = results4[slot[i]];
+            } else if (family[i] == AF_INET6) {
+                matched = matched6[slot[i]];
+                if (matched)
+                    as = results6[slot[i]];
             } else
                 throw runtime_error("Unknown Ip address family");
 
-            cout << as << endl;
-        } catch (out_of_range& e) {
-            cout << "-" << endl;
+            if (matched) {
+                snprintf(numBuf, sizeof(numBuf), "%d\n", as);
+                out += numBuf;
+            } else {
+                out += "-\n";
+            }
+        }
+    }
+}
+
+/**
+ * Resolves addresses read from stdin, one per line, as a three stage
+ * pipeline: a reader thread fills blocks from a small recycled pool and
+ * splits them into lines in place, this thread resolves the lines, and a
+ * writer thread drains finished result buffers to stdout. Between two
+ * processes in a shell pipeline the stages overlap, so pipe stalls on
+ * either end no longer serialize with the lookups and throughput is set
+ * by the slowest stage instead of their sum. The buffer pools circulate
+ * through bounded queues under two mutexes - at one handoff per
+ * IO_BLOCK_SIZE the queue traffic is negligible, a lock free ring would
+ * buy nothing here. FIFO queues and the single lookup stage keep output
+ * in input order.
+ */
+template <class Dict4>
+void printAppropriateAs(Dict4& dict4, Subnet6Dict& dict6) {
+    struct Block {
+        vector<char> text;          // raw input block, lines NUL terminated
+        vector<const char*> lines;  // pointers into text
+    };
+
+    struct Pipe {
+        deque<Block*> freeBlocks;       // recycled by the lookup stage
+        deque<Block*> filledBlocks;
+        bool readerDone;
+        string readerError;             // thrown on this thread after the join
+        mutex blockMutex;
+        condition_variable blockCond;   // lookup waits for filled blocks
+        condition_variable freeCond;    // reader waits for recycled blocks
+
+        deque<string*> freeOut;         // recycled by the writer
+        deque<string*> filledOut;
+        bool lookupDone;
+        mutex outMutex;
+        condition_variable outCond;     // writer waits for results
+        condition_variable outFreeCond; // lookup waits for recycled buffers
+    } p;
+
+    Block blockPool[PIPELINE_DEPTH];
+    string outPool[PIPELINE_DEPTH];
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+        p.freeBlocks.push_back(&blockPool[i]);
+        p.freeOut.push_back(&outPool[i]);
+    }
+    p.readerDone = false;
+    p.lookupDone = false;
+
+    thread reader([&p]() {
+        vector<char> tailCarry;
+        bool lastBlock = false;
+        while (!lastBlock) {
+            Block* blk;
+            {
+                unique_lock<mutex> lock(p.blockMutex);
+                while (p.freeBlocks.empty())
+                    p.freeCond.wait(lock);
+                blk = p.freeBlocks.front();
+                p.freeBlocks.pop_front();
+            }
+
+            blk->text.resize(tailCarry.size() + IO_BLOCK_SIZE + 1 + LINE_OVERREAD);
+            if (!tailCarry.empty())
+                memcpy(&blk->text[0], &tailCarry[0], tailCarry.size());
+
+            size_t got = readStdinBlock(&blk->text[tailCarry.size()], IO_BLOCK_SIZE);
+            size_t avail = tailCarry.size() + got;
+            lastBlock = (got == 0);
+
+            blk->lines.clear();
+            size_t tail = splitLines(&blk->text[0], avail, lastBlock, blk->lines);
+
+            if (avail - tail >= IO_BLOCK_SIZE) {
+                p.readerError = "Input line too long";
+                lastBlock = true;
+            }
+            // partial tail line moves into the next block
+            tailCarry.assign(blk->text.begin() + tail, blk->text.begin() + avail);
+
+            unique_lock<mutex> lock(p.blockMutex);
+            if (blk->lines.empty())
+                p.freeBlocks.push_back(blk);
+            else
+                p.filledBlocks.push_back(blk);
+            p.blockCond.notify_one();
+        }
+
+        unique_lock<mutex> lock(p.blockMutex);
+        p.readerDone = true;
+        p.blockCond.notify_one();
+    });
+
+    thread writer([&p]() {
+        for (;;) {
+            string* out;
+            {
+                unique_lock<mutex> lock(p.outMutex);
+                while (p.filledOut.empty() && !p.lookupDone)
+                    p.outCond.wait(lock);
+                if (p.filledOut.empty())
+                    break;
+                out = p.filledOut.front();
+                p.filledOut.pop_front();
+            }
+
+            cout.write(out->data(), out->size());
+
+            unique_lock<mutex> lock(p.outMutex);
+            p.freeOut.push_back(out);
+            p.outFreeCond.notify_one();
+        }
+    });
+
+    // lookup stage runs here, between the two I/O threads
+    for (;;) {
+        Block* blk;
+        {
+            unique_lock<mutex> lock(p.blockMutex);
+            while (p.filledBlocks.empty() && !p.readerDone)
+                p.blockCond.wait(lock);
+            if (p.filledBlocks.empty())
+                break;
+            blk = p.filledBlocks.front();
+            p.filledBlocks.pop_front();
+        }
+
+        string* out;
+        {
+            unique_lock<mutex> lock(p.outMutex);
+            while (p.freeOut.empty())
+                p.outFreeCond.wait(lock);
+            out = p.freeOut.front();
+            p.freeOut.pop_front();
+        }
+
+        out->clear();
+        resolveAddresses(&blk->lines[0], blk->lines.size(), dict4, dict6, *out);
+
+        {
+            unique_lock<mutex> lock(p.blockMutex);
+            p.freeBlocks.push_back(blk);
+            p.freeCond.notify_one();
+        }
+        {
+            unique_lock<mutex> lock(p.outMutex);
+            p.filledOut.push_back(out);
+            p.outCond.notify_one();
+        }
+    }
+
+    {
+        unique_lock<mutex> lock(p.outMutex);
+        p.lookupDone = true;
+        p.outCond.notify_one();
+    }
+
+    reader.join();
+    writer.join();
+    cout.flush();
+
+    if (!p.readerError.empty())
+        throw runtime_error(p.readerError);
+}
+
+/**
+ * Multithreaded variant of printAppropriateAs().
+ *
+ * The calling thread shards stdin into jobs of one read() block each and
+ * feeds them to numThreads workers over a bounded queue; searchBest is
+ * read-only so workers share the tries without locking. A dedicated writer
+ * thread reassembles finished jobs in input order before printing. Each job
+ * owns its block and workers parse lines in place, as printAppropriateAs().
+ */
+template <class Dict4>
+void printAppropriateAsParallel(Dict4& dict4, Subnet6Dict& dict6, size_t numThreads) {
+    struct Job {
+        size_t seq;
+        vector<char> text;          // raw input block, lines NUL terminated
+        vector<const char*> lines;  // pointers into text
+        string out;
+    };
+
+    struct Queues {
+        deque<Job*> pending;
+        bool readerDone;
+        size_t maxPending;
+        mutex inMutex;
+        condition_variable inCond;      // workers wait for jobs
+        condition_variable spaceCond;   // reader waits for queue space
+
+        map<size_t, Job*> finished;
+        bool allQueued;                 // reader finished, totalJobs is final
+        size_t totalJobs;
+        mutex outMutex;
+        condition_variable outCond;     // writer waits for next job in order
+    } q;
+
+    q.readerDone = false;
+    q.maxPending = numThreads * 4;
+    q.allQueued = false;
+    q.totalJobs = 0;
+
+    vector<thread> workers;
+    for (size_t t = 0; t < numThreads; t++) {
+        workers.push_back(thread([&q, &dict4, &dict6]() {
+            for (;;) {
+                Job* job;
+                {
+                    unique_lock<mutex> lock(q.inMutex);
+                    while (q.pending.empty() && !q.readerDone)
+                        q.inCond.wait(lock);
+                    if (q.pending.empty())
+                        break;
+                    job = q.pending.front();
+                    q.pending.pop_front();
+                    q.spaceCond.notify_one();
+                }
+
+                resolveAddresses(&job->lines[0], job->lines.size(), dict4, dict6, job->out);
+
+                {
+                    unique_lock<mutex> lock(q.outMutex);
+                    q.finished[job->seq] = job;
+                    q.outCond.notify_one();
+                }
+            }
+        }));
+    }
+
+    thread writer([&q]() {
+        size_t nextSeq = 0;
+        for (;;) {
+            Job* job;
+            {
+                unique_lock<mutex> lock(q.outMutex);
+                while (q.finished.find(nextSeq) == q.finished.end()) {
+                    if (q.allQueued && nextSeq >= q.totalJobs)
+                        return;
+                    q.outCond.wait(lock);
+                }
+                job = q.finished[nextSeq];
+                q.finished.erase(nextSeq);
+            }
+            cout << job->out;
+            delete job;
+            nextSeq++;
         }
+    });
+
+    // shard input into one job per block on this thread
+    size_t seq = 0;
+    vector<char> tailCarry;
+    bool lastBlock = false;
+    while (!lastBlock) {
+        Job* job = new Job();
+        job->seq = seq;
+        job->text.resize(tailCarry.size() + IO_BLOCK_SIZE + 1 + LINE_OVERREAD);
+        if (!tailCarry.empty())
+            memcpy(&job->text[0], &tailCarry[0], tailCarry.size());
+
+        size_t got = readStdinBlock(&job->text[tailCarry.size()], IO_BLOCK_SIZE);
+        size_t avail = tailCarry.size() + got;
+        lastBlock = (got == 0);
+
+        size_t tail = splitLines(&job->text[0], avail, lastBlock, job->lines);
+
+        // partial tail line moves into the next job's block
+        if (avail - tail >= IO_BLOCK_SIZE)
+            throw runtime_error("Input line too long");
+        tailCarry.assign(job->text.begin() + tail, job->text.begin() + avail);
+
+        if (job->lines.empty()) {
+            delete job;
+            continue;
+        }
+
+        unique_lock<mutex> lock(q.inMutex);
+        while (q.pending.size() >= q.maxPending)
+            q.spaceCond.wait(lock);
+        q.pending.push_back(job);
+        q.inCond.notify_one();
+        seq++;
+    }
+
+    {
+        unique_lock<mutex> lock(q.inMutex);
+        q.readerDone = true;
+        q.inCond.notify_all();
+    }
+    {
+        unique_lock<mutex> lock(q.outMutex);
+        q.allQueued = true;
+        q.totalJobs = seq;
+        q.outCond.notify_one();
+    }
+
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    writer.join();
+    cout.flush();
+}
+
+// -DLPM_STATS builds expose the BinaryTrie lookup counters; the report can
+// also be requested from a running process with SIGUSR1
+#if defined(LPM_STATS) && !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+static Subnet4Dict* statsDict4 = NULL;
+static Subnet6Dict* statsDict6 = NULL;
+
+void dumpLookupStats() {
+    if (statsDict4) {
+        cerr << "family v4" << endl;
+        statsDict4->dumpStats(cerr);
+    }
+    if (statsDict6) {
+        cerr << "family v6" << endl;
+        statsDict6->dumpStats(cerr);
+    }
+}
+
+#ifndef WIN32
+extern "C" void onStatsSignal(int) {
+    // stream output isn't async-signal-safe, but this is a diagnostic
+    // build and the report is worth more than the formal guarantee
+    dumpLookupStats();
+}
+#endif
+#endif	/* LPM_STATS */
+
+#if !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+// prints index4/index6 entries under `as` as "address/len" lines, trie order
+template <size_t N>
+void printIndexedPrefixes(const ReverseIndex<N, int>& index, int as, int family) {
+    const vector<BitArray<N> >* keys = index.find(as);
+    if (keys == NULL)
+        return;
+
+    for (size_t i = 0; i < keys->size(); i++) {
+        BitArray<N> key = (*keys)[i];
+        maskKeyTail(key);       // stored keys may carry junk past the prefix
+        char text[INET6_ADDRSTRLEN];
+        if (inet_ntop(family, key.internalStorage(), text, sizeof(text)) != NULL)
+            cout << text << "/" << key.size() << "\n";
     }
 }
 
+/**
+ * Answers the inverse query: every prefix the table maps to AS `as`,
+ * IPv4 prefixes first, each family in trie order. Served from
+ * ReverseIndex instances built off the loaded tries, so the route file
+ * isn't re-parsed and the tries aren't re-walked per query.
+ */
+/// prints both tries' dumpMemReport() with family headers, dumpLookupStats() style
+void printMemReport(const Subnet4Dict& dict4, const Subnet6Dict& dict6) {
+    cout << "family v4" << "\n";
+    dict4.dumpMemReport(cout);
+    cout << "family v6" << "\n";
+    dict6.dumpMemReport(cout);
+    cout.flush();
+}
+
+void printPrefixesForAs(const Subnet4Dict& dict4, const Subnet6Dict& dict6, int as) {
+    ReverseIndex<sizeof(in_addr), int> index4;
+    ReverseIndex<sizeof(in6_addr), int> index6;
+    index4.buildFrom(dict4);
+    index6.buildFrom(dict6);
+
+    printIndexedPrefixes(index4, as, AF_INET);
+    printIndexedPrefixes(index6, as, AF_INET6);
+    cout.flush();
+}
+#endif	/* !LPM_MULTIBIT && !LPM_TREEBITMAP && !LPM_POPTRIE */
+
 void printUsageAndHelp() {
     static const char* str =
-        "Usage:  lpm -i FILE\n"
-        "   FILE input file containing subnets and AS numbers\n\n"
+        "Usage:  lpm -i FILE [-c CACHE] [-j N] [--engine NAME] [--numa NODE]\n"
+        "            [--aggregate] [--as AS] [--mem-report]\n"
+        "   FILE  input file containing subnets and AS numbers\n"
+        "   CACHE binary snapshot of the built tries; loaded via mmap when it\n"
+        "         exists, created from FILE otherwise\n"
+        "   N     number of lookup threads (default 1)\n"
+        "   NAME  IPv4 lookup engine: trie (default) or dir24, the\n"
+        "         memory-hungry DIR-24-8 full-expansion table\n"
+        "   NODE  NUMA node to bind trie storage to; needs a build with\n"
+        "         -DLPM_HUGEPAGES\n"
+        "   --aggregate  minimize the prefix table before loading; lookups\n"
+        "         resolve identically but the table is smaller and shallower\n"
+        "   --as AS  inverse query: print all prefixes mapped to AS number AS\n"
+        "         instead of resolving addresses from stdin\n"
+        "   --mem-report  print a per-trie memory and layout report after\n"
+        "         loading instead of resolving addresses from stdin\n\n"
         "Program expects list of IPv4/IPv6 addresses separated by newline at stdin\n"
         "and prints AS numbers corresponding to individual addresses.";
 
@@ -147,11 +1407,66 @@ void printUsageAndHelp() {
 
 int main(int argc, char** argv) {
 
+    const char* inputFile = NULL;
+    const char* cacheFile = NULL;
+    const char* engine = "trie";
+    size_t numThreads = 1;
+    int numaNode = -1;
+    bool aggregate = false;
+    const char* asQuery = NULL;
+    bool memReport = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            inputFile = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            cacheFile = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            numThreads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+            engine = argv[++i];
+        else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc)
+            numaNode = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--aggregate") == 0)
+            aggregate = true;
+        else if (strcmp(argv[i], "--as") == 0 && i + 1 < argc)
+            asQuery = argv[++i];
+        else if (strcmp(argv[i], "--mem-report") == 0)
+            memReport = true;
+        else {
+            printUsageAndHelp();
+            return 1;
+        }
+    }
+
     // handle bad input args
-    if (argc != 3 || strcmp(argv[1], "-i") != 0) {
+    if (inputFile == NULL && cacheFile == NULL) {
+        printUsageAndHelp();
+        return 1;
+    }
+    bool useDir24 = (strcmp(engine, "dir24") == 0);
+    if (!useDir24 && strcmp(engine, "trie") != 0) {
         printUsageAndHelp();
         return 1;
     }
+#ifndef LPM_HUGEPAGES
+    if (numaNode >= 0) {
+        cerr << "--numa requires a build with -DLPM_HUGEPAGES" << endl;
+        return 1;
+    }
+#endif
+#if defined(LPM_MULTIBIT) || defined(LPM_TREEBITMAP) || defined(LPM_POPTRIE)
+    // the inverse query and the layout report walk the trie, which the
+    // stride engines don't offer
+    if (asQuery) {
+        cerr << "--as isn't supported with this engine" << endl;
+        return 1;
+    }
+    if (memReport) {
+        cerr << "--mem-report isn't supported with this engine" << endl;
+        return 1;
+    }
+#endif
 
 #ifdef WIN32
     // init wsa for socket api
@@ -163,12 +1478,88 @@ int main(int argc, char** argv) {
     }
 #endif
 
+#ifdef LPM_HUGEPAGES
+    HugePageAlloc<char> arena(numaNode);
+    Subnet4Dict dict4(arena);
+    Subnet6Dict dict6(arena);
+#else
     Subnet4Dict dict4;
     Subnet6Dict dict6;
-    parseInputFile(argv[2], dict4, dict6);
+#endif
+    Dir24Table<int> dir24;      // allocates lazily, harmless when unused
+
+#if defined(LPM_STATS) && !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+    statsDict4 = &dict4;
+    statsDict6 = &dict6;
+#ifndef WIN32
+    signal(SIGUSR1, onStatsSignal);
+#endif
+#endif
 
 	std::ios_base::sync_with_stdio(false);
-    printAppropriateAs(std::cin, dict4, dict6);
+
+    if (useDir24) {
+        // dir24 table is rebuilt from text input on every start
+        if (cacheFile) {
+            cerr << "Snapshot cache isn't supported with the dir24 engine" << endl;
+            return 1;
+        }
+        if (asQuery) {
+            cerr << "--as isn't supported with the dir24 engine" << endl;
+            return 1;
+        }
+        if (memReport) {
+            cerr << "--mem-report isn't supported with the dir24 engine" << endl;
+            return 1;
+        }
+        parseInputFile(inputFile, dir24, dict6, aggregate, numThreads);
+        invalidateLookupCaches();
+
+        if (numThreads > 1)
+            printAppropriateAsParallel(dir24, dict6, numThreads);
+        else
+            printAppropriateAs(dir24, dict6);
+    } else {
+#if !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+        bool loaded = false;
+        if (cacheFile)
+            loaded = loadSnapshotFile(cacheFile, dict4, dict6);
+
+        if (!loaded) {
+            if (inputFile == NULL) {
+                cerr << "No usable snapshot and no input file given" << endl;
+                return 1;
+            }
+            parseInputFile(inputFile, dict4, dict6, aggregate, numThreads);
+            if (cacheFile)
+                saveSnapshotFile(cacheFile, dict4, dict6);
+        }
+#else
+        // stride engines have no snapshot support
+        if (cacheFile) {
+            cerr << "Snapshot cache isn't supported with this engine" << endl;
+            return 1;
+        }
+        parseInputFile(inputFile, dict4, dict6, aggregate, numThreads);
+#endif
+        invalidateLookupCaches();
+
+#if !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+        if (memReport)
+            printMemReport(dict4, dict6);
+        else if (asQuery)
+            printPrefixesForAs(dict4, dict6, atoi(asQuery));
+        else
+#endif
+        if (numThreads > 1)
+            printAppropriateAsParallel(dict4, dict6, numThreads);
+        else
+            printAppropriateAs(dict4, dict6);
+    }
+
+#if defined(LPM_STATS) && !defined(LPM_MULTIBIT) && !defined(LPM_TREEBITMAP) && !defined(LPM_POPTRIE)
+    dumpLookupStats();
+#endif
 
 #ifdef WIN32
     WSACleanup();
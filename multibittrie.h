@@ -0,0 +1,217 @@
+/**
+ * @file multibittrie.h
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * File with class MultibitTrie
+ */
+
+#ifndef MULTIBITTRIE_H
+#define	MULTIBITTRIE_H
+
+#include "bitarray.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Multibit trie resolving STRIDE bits of the key per node.
+ *
+ * Each node is a 256-entry table indexed by one key byte. Prefixes whose
+ * length isn't a stride multiple are expanded over the covered entry range
+ * (controlled prefix expansion), each entry remembering the length of the
+ * prefix that claimed it so longer prefixes keep priority. Lookup thus
+ * touches at most one node per key byte and needs no backtracking.
+ */
+template <size_t N, class T>
+class MultibitTrie
+{
+public:
+    typedef T mapped_type;
+    typedef BitArray<N> key_type;
+
+    static const size_t STRIDE = 8;
+
+    MultibitTrie() : root(NIL), numNodes(0) { }
+
+    void clear() {
+        std::vector<Node>().swap(nodes);
+        root = NIL;
+        numNodes = 0;
+    }
+
+    bool empty() const {
+        return root == NIL;
+    }
+
+    size_t size() const {
+        return numNodes;
+    }
+
+    // bytes held by the node pool, including slack capacity
+    size_t memoryFootprint() const {
+        return nodes.capacity() * sizeof(Node);
+    }
+
+    void insert(const key_type& key, const mapped_type& value) {
+        if (root == NIL)
+            root = allocNode();
+
+        const unsigned char* kb = key.internalStorage();
+        size_t len = key.size();
+        uint32_t cur = root;
+
+        if (len == 0) {
+            // default route covers whole root table
+            expand(cur, 0, 256, 0, value);
+            return;
+        }
+
+        // descend full strides, creating nodes on the way
+        size_t depth = (len - 1) / STRIDE;
+        for (size_t i = 0; i < depth; i++) {
+            uint32_t child = nodes[cur].entries[kb[i]].child;
+            if (child == NIL) {
+                child = allocNode();
+                nodes[cur].entries[kb[i]].child = child;
+            }
+            cur = child;
+        }
+
+        // expand remaining bits over covered entry range
+        size_t remBits = len - depth * STRIDE;
+        unsigned base = kb[depth] & (0xff << (STRIDE - remBits)) & 0xff;
+        unsigned span = 1u << (STRIDE - remBits);
+        expand(cur, base, base + span, len, value);
+    }
+
+    mapped_type& best(const key_type& key) {
+        mapped_type* found = searchBest(key);
+        if (found)
+            return *found;
+        else
+            throw std::out_of_range("MultibitTrie::best: no prefixes in trie for given key");
+    }
+
+    /**
+     * Longest-prefix match for n keys at once, interleaving the per-level
+     * table walks and prefetching each lane's next node. results[i] is
+     * written only when matched[i] is set to true.
+     */
+    void bestBatch(const key_type* keys, mapped_type* results, bool* matched, size_t n) {
+        static const size_t LANES = 16;
+
+        for (size_t base = 0; base < n; base += LANES) {
+            size_t cnt = (n - base < LANES) ? n - base : LANES;
+
+            uint32_t node[LANES];
+            mapped_type* found[LANES];
+            size_t running = 0;
+
+            for (size_t i = 0; i < cnt; i++) {
+                node[i] = root;
+                found[i] = NULL;
+                if (root != NIL) {
+                    __builtin_prefetch(&nodes[root].entries[keys[base + i].internalStorage()[0]]);
+                    running++;
+                }
+            }
+
+            for (size_t level = 0; running > 0; level++) {
+                for (size_t i = 0; i < cnt; i++) {
+                    if (node[i] == NIL)
+                        continue;
+
+                    const key_type& key = keys[base + i];
+                    if (level * STRIDE >= key.size()) {
+                        node[i] = NIL;
+                        running--;
+                        continue;
+                    }
+
+                    Entry& e = nodes[node[i]].entries[key.internalStorage()[level]];
+                    if (e.pfxLen != NO_PREFIX)
+                        found[i] = &e.value;
+
+                    node[i] = e.child;
+                    if (e.child == NIL)
+                        running--;
+                    else if ((level + 1) * STRIDE < key.size())
+                        __builtin_prefetch(&nodes[e.child].entries[key.internalStorage()[level + 1]]);
+                }
+            }
+
+            for (size_t i = 0; i < cnt; i++) {
+                matched[base + i] = (found[i] != NULL);
+                if (found[i])
+                    results[base + i] = *found[i];
+            }
+        }
+    }
+private:
+    MultibitTrie(const MultibitTrie&);
+    MultibitTrie& operator=(const MultibitTrie&);
+
+    // invalid node index
+    static const uint32_t NIL = 0xffffffffu;
+    // entry holds no expanded prefix
+    static const uint8_t NO_PREFIX = 0xff;
+
+    struct Entry
+    {
+        Entry() : child(NIL), pfxLen(NO_PREFIX) { }
+
+        uint32_t child;         // index of next-level node
+        mapped_type value;      // best-match value expanded into this entry
+        uint8_t pfxLen;         // original length of prefix that claimed entry
+    };
+
+    struct Node
+    {
+        Entry entries[256];
+    };
+
+    uint32_t allocNode() {
+        nodes.push_back(Node());
+        numNodes++;
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    void expand(uint32_t node, unsigned from, unsigned to, size_t len, const mapped_type& value) {
+        for (unsigned i = from; i < to; i++) {
+            Entry& e = nodes[node].entries[i];
+            // longer prefix keeps its claim, equal prefix gets overwritten
+            if (e.pfxLen == NO_PREFIX || e.pfxLen <= len) {
+                e.pfxLen = static_cast<uint8_t>(len);
+                e.value = value;
+            }
+        }
+    }
+
+    mapped_type* searchBest(const key_type& key) {
+        if (root == NIL)
+            return NULL;
+
+        const unsigned char* kb = key.internalStorage();
+        size_t numBytes = (key.size() + STRIDE - 1) / STRIDE;
+
+        mapped_type* found = NULL;
+        uint32_t cur = root;
+        for (size_t i = 0; i < numBytes && cur != NIL; i++) {
+            Entry& e = nodes[cur].entries[kb[i]];
+            if (e.pfxLen != NO_PREFIX)
+                found = &e.value;
+            cur = e.child;
+        }
+
+        return found;
+    }
+
+    std::vector<Node> nodes;    // contiguous node pool addressed by 32bit indices
+    uint32_t root;
+    size_t numNodes;
+};
+
+#endif	/* MULTIBITTRIE_H */
@@ -0,0 +1,343 @@
+/**
+ * @file poptrie.h
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * File with class PoptrieTrie
+ */
+
+#ifndef POPTRIE_H
+#define	POPTRIE_H
+
+#include "bitarray.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+/**
+ * Poptrie-style succinct trie resolving 6 key bits per node.
+ *
+ * A node is two 64-bit bitmaps and two bases: vec marks which of the 64
+ * chunk values continue into a child, leafvec marks where runs of equal
+ * leaf results start. Children and leaf values are packed into two flat
+ * arrays and found by counting set bits below the wanted position, so a
+ * node is 24 bytes, descent is one popcount per level and the final
+ * answer is read directly from the leaf array - no key comparison and no
+ * per-node value storage at all. Longer prefixes are leaf-pushed into
+ * the subtrees they cover during the build.
+ *
+ * Inserts stage the prefixes and the packed form is (re)built lazily on
+ * the first lookup, the same way the table is loaded once and then only
+ * queried.
+ */
+template <size_t N, class T>
+class PoptrieTrie
+{
+public:
+    typedef T mapped_type;
+    typedef BitArray<N> key_type;
+
+    static const size_t STRIDE = 6;
+
+    PoptrieTrie() : numPrefixes(0), dirty(false) { }
+
+    void clear() {
+        std::vector<Pfx>().swap(staged);
+        std::vector<Node>().swap(nodes);
+        std::vector<Leaf>().swap(leaves);
+        numPrefixes = 0;
+        dirty = false;
+    }
+
+    bool empty() const {
+        return numPrefixes == 0;
+    }
+
+    size_t size() const {
+        return numPrefixes;
+    }
+
+    // bytes held by the packed arrays and the staged prefixes
+    size_t memoryFootprint() const {
+        return nodes.capacity() * sizeof(Node) + leaves.capacity() * sizeof(Leaf)
+            + staged.capacity() * sizeof(Pfx);
+    }
+
+    void insert(const key_type& key, const mapped_type& value) {
+        Pfx p;
+        p.key = key;
+        p.len = static_cast<uint32_t>(key.size());
+        p.value = value;
+        staged.push_back(p);
+        numPrefixes++;
+        dirty = true;
+    }
+
+    mapped_type& best(const key_type& key) {
+        Leaf* leaf = lookup(key);
+        if (leaf)
+            return leaf->value;
+        else
+            throw std::out_of_range("PoptrieTrie::best: no prefixes in trie for given key");
+    }
+
+    /**
+     * Longest-prefix match for n keys at once, interleaving the per-level
+     * node walks and prefetching each lane's next node. results[i] is
+     * written only when matched[i] is set to true.
+     */
+    void bestBatch(const key_type* keys, mapped_type* results, bool* matched, size_t n) {
+        static const size_t LANES = 16;
+
+        ensureBuilt();
+
+        for (size_t base = 0; base < n; base += LANES) {
+            size_t cnt = (n - base < LANES) ? n - base : LANES;
+
+            uint32_t node[LANES];
+            Leaf* found[LANES];
+            size_t running = cnt;
+
+            for (size_t i = 0; i < cnt; i++) {
+                node[i] = nodes.empty() ? NIL : 0;
+                found[i] = NULL;
+                if (node[i] == NIL)
+                    running--;
+            }
+
+            for (size_t level = 0; running > 0; level++) {
+                size_t depth = level * STRIDE;
+                for (size_t i = 0; i < cnt; i++) {
+                    if (node[i] == NIL)
+                        continue;
+
+                    const key_type& key = keys[base + i];
+                    const Node& nd = nodes[node[i]];
+                    size_t rem = key.size() - depth;
+                    uint64_t v = extractBits(key, depth, (rem < STRIDE) ? rem : STRIDE);
+
+                    if (nd.vec & (1ull << v)) {
+                        node[i] = nd.base1 + popcnt64(nd.vec & ((1ull << v) - 1));
+                        __builtin_prefetch(&nodes[node[i]]);
+                        continue;
+                    }
+
+                    uint64_t below = nd.leafvec & maskThrough(v);
+                    if (below)
+                        found[i] = &leaves[nd.base0 + popcnt64(below) - 1];
+                    node[i] = NIL;
+                    running--;
+                }
+            }
+
+            for (size_t i = 0; i < cnt; i++) {
+                bool hit = (found[i] != NULL && found[i]->matched);
+                matched[base + i] = hit;
+                if (hit)
+                    results[base + i] = found[i]->value;
+            }
+        }
+    }
+private:
+    PoptrieTrie(const PoptrieTrie&);
+    PoptrieTrie& operator=(const PoptrieTrie&);
+
+    // invalid node index
+    static const uint32_t NIL = 0xffffffffu;
+
+    struct Node
+    {
+        Node() : vec(0), leafvec(0), base1(0), base0(0) { }
+
+        uint64_t vec;           // chunk values continuing into a child
+        uint64_t leafvec;       // starts of equal-valued leaf runs
+        uint32_t base1;         // first child in the node array
+        uint32_t base0;         // first leaf run value in the leaf array
+    };
+
+    struct Leaf
+    {
+        mapped_type value;
+        uint8_t matched;        // 0 marks the no-covering-prefix leaf
+    };
+
+    struct Pfx
+    {
+        key_type key;
+        uint32_t len;
+        mapped_type value;
+    };
+
+    static uint64_t popcnt64(uint64_t v) {
+        return __builtin_popcountll(v);
+    }
+
+    // bits 0..v inclusive
+    static uint64_t maskThrough(uint64_t v) {
+        return (v == 63) ? ~0ull : ((1ull << (v + 1)) - 1);
+    }
+
+    static uint64_t extractBits(const key_type& key, size_t pos, size_t count) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < count; i++)
+            v = (v << 1) | (key[pos + i] ? 1 : 0);
+        return v;
+    }
+
+    // terminals expand shortest first so longer prefixes overwrite
+    static bool pfxLenLess(const Pfx& a, const Pfx& b) {
+        return a.len < b.len;
+    }
+
+    void ensureBuilt() {
+        if (dirty)
+            build();
+    }
+
+    Leaf* lookup(const key_type& key) {
+        ensureBuilt();
+        if (nodes.empty())
+            return NULL;
+
+        uint32_t n = 0;
+        size_t depth = 0;
+        for (;;) {
+            const Node& nd = nodes[n];
+            size_t rem = key.size() - depth;
+            uint64_t v = extractBits(key, depth, (rem < STRIDE) ? rem : STRIDE);
+
+            if (nd.vec & (1ull << v)) {
+                n = nd.base1 + popcnt64(nd.vec & ((1ull << v) - 1));
+                depth += STRIDE;
+                continue;
+            }
+
+            uint64_t below = nd.leafvec & maskThrough(v);
+            if (!below)
+                return NULL;
+            Leaf& leaf = leaves[nd.base0 + popcnt64(below) - 1];
+            return leaf.matched ? &leaf : NULL;
+        }
+    }
+
+    /**
+     * Rebuilds the packed arrays from the staged prefixes, BFS so every
+     * node's children land contiguously. Each queue item carries the
+     * prefixes extending past its node and the best covering leaf
+     * inherited from above, which is how longer prefixes get pushed into
+     * the subtrees between runs of shorter ones.
+     */
+    void build() {
+        struct BuildItem
+        {
+            uint32_t node;
+            size_t depth;
+            std::vector<Pfx> pfx;
+            Leaf inherited;
+        };
+
+        nodes.clear();
+        leaves.clear();
+        dirty = false;
+        if (staged.empty())
+            return;
+
+        std::vector<BuildItem> queue;
+        nodes.push_back(Node());
+        BuildItem root;
+        root.node = 0;
+        root.depth = 0;
+        root.pfx = staged;
+        root.inherited.value = mapped_type();
+        root.inherited.matched = 0;
+        queue.push_back(root);
+
+        for (size_t head = 0; head < queue.size(); head++) {
+            BuildItem item = queue[head];
+            std::vector<Pfx>().swap(queue[head].pfx);       // keep queue memory flat
+
+            size_t chunkBits = N * 8 - item.depth;
+            if (chunkBits > STRIDE)
+                chunkBits = STRIDE;
+            size_t slots = size_t(1) << chunkBits;
+
+            // best terminating prefix per chunk value, seeded from above
+            Leaf val[64];
+            for (size_t s = 0; s < slots; s++)
+                val[s] = item.inherited;
+
+            std::vector<Pfx> terminal;
+            std::vector<Pfx> extending[64];
+            for (size_t i = 0; i < item.pfx.size(); i++) {
+                if (item.pfx[i].len <= item.depth + chunkBits)
+                    terminal.push_back(item.pfx[i]);
+                else
+                    extending[extractBits(item.pfx[i].key, item.depth, STRIDE)].push_back(item.pfx[i]);
+            }
+
+            // shortest first, so longer prefixes overwrite the slots they
+            // narrow; equal lengths keep insert order for last-wins
+            std::stable_sort(terminal.begin(), terminal.end(), pfxLenLess);
+            for (size_t i = 0; i < terminal.size(); i++) {
+                size_t bits = terminal[i].len - item.depth;
+                size_t first = size_t(extractBits(terminal[i].key, item.depth, bits)) << (chunkBits - bits);
+                size_t count = size_t(1) << (chunkBits - bits);
+                for (size_t s = first; s < first + count; s++) {
+                    val[s].value = terminal[i].value;
+                    val[s].matched = 1;
+                }
+            }
+
+            Node nd;
+            nd.base1 = static_cast<uint32_t>(nodes.size());
+            nd.base0 = static_cast<uint32_t>(leaves.size());
+
+            uint32_t children = 0;
+            for (size_t s = 0; s < slots; s++) {
+                if (!extending[s].empty()) {
+                    nd.vec |= 1ull << s;
+                    children++;
+                }
+            }
+            nodes.resize(nodes.size() + children);
+
+            uint32_t child = nd.base1;
+            bool haveLeaf = false;
+            Leaf last;
+            for (size_t s = 0; s < slots; s++) {
+                if (nd.vec & (1ull << s)) {
+                    BuildItem sub;
+                    sub.node = child++;
+                    sub.depth = item.depth + STRIDE;
+                    sub.pfx.swap(extending[s]);
+                    sub.inherited = val[s];
+                    queue.push_back(sub);
+                    continue;
+                }
+
+                // a leaf run starts where the result changes; runs may
+                // continue across child slots, lookup only counts starts
+                if (!haveLeaf || last.matched != val[s].matched
+                        || (val[s].matched && !(last.value == val[s].value))) {
+                    nd.leafvec |= 1ull << s;
+                    leaves.push_back(val[s]);
+                    last = val[s];
+                    haveLeaf = true;
+                }
+            }
+
+            nodes[item.node] = nd;
+        }
+    }
+
+    std::vector<Pfx> staged;        // inserted prefixes, source of the build
+    std::vector<Node> nodes;        // packed nodes, root at index 0
+    std::vector<Leaf> leaves;       // packed leaf run values
+    size_t numPrefixes;
+    bool dirty;                     // staged prefixes not yet built
+};
+
+#endif	/* POPTRIE_H */
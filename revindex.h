@@ -0,0 +1,101 @@
+/**
+ * @file revindex.h
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * File with class ReverseIndex
+ */
+
+#ifndef REVINDEX_H
+#define	REVINDEX_H
+
+#include "bitarray.h"
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+/**
+ * Inverted value-to-prefixes index kept alongside a lookup structure, so
+ * "which prefixes map to AS X" is answered in O(answer) instead of
+ * re-walking the whole trie or re-parsing the route file. Prefixes are
+ * stored by key, not by node reference - node slots move under RCU
+ * rebuilds, keys don't.
+ *
+ * Build it in one go with buildFrom() after a bulk load, or keep it
+ * current by mirroring every updateInsert()/updateWithdraw() with add()
+ * and remove(). The index doesn't observe the trie by itself; a caller
+ * that mutates the trie without telling the index gets stale answers.
+ */
+template <size_t N, class T>
+class ReverseIndex
+{
+public:
+    typedef T mapped_type;
+    typedef BitArray<N> key_type;
+
+    void clear() {
+        index.clear();
+    }
+
+    bool empty() const {
+        return index.empty();
+    }
+
+    /// number of distinct values with at least one prefix
+    size_t size() const {
+        return index.size();
+    }
+
+    /// Rebuilds the index from dict's current content via its forEach().
+    template <class Dict>
+    void buildFrom(const Dict& dict) {
+        index.clear();
+        ReverseIndex& self = *this;
+        dict.forEach([&self](const key_type& key, const mapped_type& value) {
+            self.index[value].push_back(key);
+        });
+    }
+
+    /// Mirrors an insert; a replaced key must be remove()d under its old value first.
+    void add(const key_type& key, const mapped_type& value) {
+        index[value].push_back(key);
+    }
+
+    /// Mirrors a withdraw; returns false when key wasn't listed under value.
+    bool remove(const key_type& key, const mapped_type& value) {
+        typename IndexMap::iterator it = index.find(value);
+        if (it == index.end())
+            return false;
+
+        std::vector<key_type>& keys = it->second;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i].size() == key.size()
+                    && keys[i].firstDifferentBit(key, key.size()) == key.size()) {
+                keys.erase(keys.begin() + i);
+                if (keys.empty())
+                    index.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * All prefixes stored under value, in the order they were indexed -
+     * trie order after buildFrom(). NULL when the value maps nothing.
+     */
+    const std::vector<key_type>* find(const mapped_type& value) const {
+        typename IndexMap::const_iterator it = index.find(value);
+        if (it == index.end())
+            return NULL;
+        return &it->second;
+    }
+private:
+    typedef std::unordered_map<mapped_type, std::vector<key_type> > IndexMap;
+
+    IndexMap index;
+};
+
+#endif	/* REVINDEX_H */
@@ -0,0 +1,275 @@
+/**
+ * @file treebitmap.h
+ *
+ * @author Jan Dušek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ *
+ * File with class TreeBitmapTrie
+ */
+
+#ifndef TREEBITMAP_H
+#define	TREEBITMAP_H
+
+#include "bitarray.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Tree Bitmap trie resolving STRIDE bits of the key per node.
+ *
+ * Unlike a full-expansion table a node burns no slots on absent entries:
+ * a 16 bit external bitmap records which of the possible children exist
+ * and a 15 bit internal bitmap records which sub-stride prefixes end in
+ * the node. Children and result values are packed contiguously and found
+ * by counting set bits below the wanted one, so a node is 12 bytes and
+ * lookup keeps multibit-stride speed at close to binary-trie memory -
+ * which is what the sparse IPv6 table needs.
+ */
+template <size_t N, class T>
+class TreeBitmapTrie
+{
+public:
+    typedef T mapped_type;
+    typedef BitArray<N> key_type;
+
+    static const size_t STRIDE = 4;
+
+    TreeBitmapTrie() : numPrefixes(0) {
+        nodes.push_back(Node());        // root lives at index 0
+    }
+
+    void clear() {
+        std::vector<Node>().swap(nodes);
+        std::vector<mapped_type>().swap(results);
+        nodes.push_back(Node());
+        numPrefixes = 0;
+    }
+
+    bool empty() const {
+        return numPrefixes == 0;
+    }
+
+    size_t size() const {
+        return numPrefixes;
+    }
+
+    // bytes held by node pool and result array, including slack capacity
+    size_t memoryFootprint() const {
+        return nodes.capacity() * sizeof(Node) + results.capacity() * sizeof(mapped_type);
+    }
+
+    void insert(const key_type& key, const mapped_type& value) {
+        size_t len = key.size();
+        uint32_t cur = 0;
+        size_t depth = 0;
+
+        // descend full strides, creating nodes on the way
+        while (len - depth >= STRIDE) {
+            cur = ensureChild(cur, nibbleAt(key, depth));
+            depth += STRIDE;
+        }
+
+        // remaining 0..STRIDE-1 bits end inside cur's internal bitmap
+        size_t rem = len - depth;
+        unsigned val = 0;
+        for (size_t i = 0; i < rem; i++)
+            val = (val << 1) | (key[depth + i] ? 1 : 0);
+        setResult(cur, (1u << rem) - 1 + val, value);
+    }
+
+    mapped_type& best(const key_type& key) {
+        const mapped_type* found = searchBest(key);
+        if (found)
+            return const_cast<mapped_type&>(*found);
+        else
+            throw std::out_of_range("TreeBitmapTrie::best: no prefixes in trie for given key");
+    }
+
+    /**
+     * Longest-prefix match for n keys at once, interleaving the per-level
+     * node walks and prefetching each lane's next node. results[i] is
+     * written only when matched[i] is set to true.
+     */
+    void bestBatch(const key_type* keys, mapped_type* resultsOut, bool* matched, size_t n) const {
+        static const size_t LANES = 16;
+
+        for (size_t base = 0; base < n; base += LANES) {
+            size_t cnt = (n - base < LANES) ? n - base : LANES;
+
+            uint32_t node[LANES];
+            const mapped_type* found[LANES];
+            size_t running = cnt;
+
+            for (size_t i = 0; i < cnt; i++) {
+                node[i] = 0;
+                found[i] = NULL;
+                __builtin_prefetch(&nodes[0]);
+            }
+
+            for (size_t level = 0; running > 0; level++) {
+                for (size_t i = 0; i < cnt; i++) {
+                    if (node[i] == NIL)
+                        continue;
+
+                    const key_type& key = keys[base + i];
+                    size_t depth = level * STRIDE;
+                    const Node& nd = nodes[node[i]];
+
+                    const mapped_type* inNode = longestInNode(nd, key, depth);
+                    if (inNode)
+                        found[i] = inNode;
+
+                    uint32_t next = NIL;
+                    if (key.size() - depth >= STRIDE) {
+                        unsigned nib = nibbleAt(key, depth);
+                        if (nd.extBitmap & (1u << nib))
+                            next = nd.childBase + popcount16(nd.extBitmap & ((1u << nib) - 1));
+                    }
+
+                    node[i] = next;
+                    if (next == NIL)
+                        running--;
+                    else
+                        __builtin_prefetch(&nodes[next]);
+                }
+            }
+
+            for (size_t i = 0; i < cnt; i++) {
+                matched[base + i] = (found[i] != NULL);
+                if (found[i])
+                    resultsOut[base + i] = *found[i];
+            }
+        }
+    }
+private:
+    TreeBitmapTrie(const TreeBitmapTrie&);
+    TreeBitmapTrie& operator=(const TreeBitmapTrie&);
+
+    // invalid node index
+    static const uint32_t NIL = 0xffffffffu;
+
+    struct Node
+    {
+        Node() : childBase(0), resultBase(0), extBitmap(0), intBitmap(0) { }
+
+        uint32_t childBase;     // first of the packed children
+        uint32_t resultBase;    // first of the packed result values
+        uint16_t extBitmap;     // bit per existing child nibble
+        uint16_t intBitmap;     // bit per sub-stride prefix ending here
+    };
+
+    static unsigned popcount16(unsigned v) {
+        return __builtin_popcount(v);
+    }
+
+    static unsigned nibbleAt(const key_type& key, size_t depth) {
+        unsigned char byte = key.internalStorage()[depth / 8];
+        return (depth % 8) ? (byte & 0xf) : (byte >> 4);
+    }
+
+    /**
+     * Returns child of node for given nibble, creating it if absent. The
+     * packed sibling block is relocated to the pool end on growth; the old
+     * block is abandoned, trading some slack for contiguity.
+     */
+    uint32_t ensureChild(uint32_t node, unsigned nib) {
+        uint16_t mask = 1u << nib;
+        unsigned before = popcount16(nodes[node].extBitmap & (mask - 1));
+        if (nodes[node].extBitmap & mask)
+            return nodes[node].childBase + before;
+
+        unsigned count = popcount16(nodes[node].extBitmap);
+        uint32_t oldBase = nodes[node].childBase;
+        uint32_t newBase = static_cast<uint32_t>(nodes.size());
+        nodes.resize(newBase + count + 1);
+
+        for (unsigned i = 0; i < before; i++)
+            nodes[newBase + i] = nodes[oldBase + i];
+        nodes[newBase + before] = Node();
+        for (unsigned i = before; i < count; i++)
+            nodes[newBase + i + 1] = nodes[oldBase + i];
+
+        nodes[node].childBase = newBase;
+        nodes[node].extBitmap |= mask;
+        return newBase + before;
+    }
+
+    void setResult(uint32_t node, unsigned bit, const mapped_type& value) {
+        uint16_t mask = 1u << bit;
+        unsigned before = popcount16(nodes[node].intBitmap & (mask - 1));
+        if (nodes[node].intBitmap & mask) {
+            // repeated insert overwrites, matching the other engines
+            results[nodes[node].resultBase + before] = value;
+            return;
+        }
+
+        unsigned count = popcount16(nodes[node].intBitmap);
+        uint32_t oldBase = nodes[node].resultBase;
+        uint32_t newBase = static_cast<uint32_t>(results.size());
+        results.resize(newBase + count + 1);
+
+        for (unsigned i = 0; i < before; i++)
+            results[newBase + i] = results[oldBase + i];
+        results[newBase + before] = value;
+        for (unsigned i = before; i < count; i++)
+            results[newBase + i + 1] = results[oldBase + i];
+
+        nodes[node].resultBase = newBase;
+        nodes[node].intBitmap |= mask;
+        numPrefixes++;
+    }
+
+    // longest prefix ending inside nd that matches key bits from depth on
+    const mapped_type* longestInNode(const Node& nd, const key_type& key, size_t depth) const {
+        if (!nd.intBitmap)
+            return NULL;
+
+        size_t rem = key.size() - depth;
+        size_t maxl = (rem < STRIDE) ? rem : STRIDE - 1;
+        unsigned val = 0;
+        for (size_t i = 0; i < maxl; i++)
+            val = (val << 1) | (key[depth + i] ? 1 : 0);
+
+        for (size_t l = maxl; ; l--) {
+            unsigned bit = (1u << l) - 1 + (val >> (maxl - l));
+            if (nd.intBitmap & (1u << bit))
+                return &results[nd.resultBase + popcount16(nd.intBitmap & ((1u << bit) - 1))];
+            if (l == 0)
+                break;
+        }
+        return NULL;
+    }
+
+    const mapped_type* searchBest(const key_type& key) const {
+        const mapped_type* found = NULL;
+        uint32_t cur = 0;
+        size_t depth = 0;
+
+        for (;;) {
+            const Node& nd = nodes[cur];
+
+            const mapped_type* inNode = longestInNode(nd, key, depth);
+            if (inNode)
+                found = inNode;
+
+            if (key.size() - depth < STRIDE)
+                break;
+
+            unsigned nib = nibbleAt(key, depth);
+            if (!(nd.extBitmap & (1u << nib)))
+                break;
+            cur = nd.childBase + popcount16(nd.extBitmap & ((1u << nib) - 1));
+            depth += STRIDE;
+        }
+
+        return found;
+    }
+
+    std::vector<Node> nodes;            // contiguous node pool, root at index 0
+    std::vector<mapped_type> results;   // packed values referenced by resultBase
+    size_t numPrefixes;
+};
+
+#endif	/* TREEBITMAP_H */